@@ -34,23 +34,24 @@ struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(
     struct aesd_circular_buffer *buffer, size_t char_offset,
     size_t *entry_offset_byte_rtn) {
 
-    int i = buffer->out_offs, j;
-    size_t cursor = 0;
+    uint32_t lo = 0, hi = aesd_circular_buffer_count(buffer), mid;
     struct aesd_buffer_entry *entry;
 
-    for (j = 0; j < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-         j++, i = (i + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) {
-
-        entry = &buffer->entry[i];
-
-        if ((cursor + entry->size) > char_offset) { // we found the entry
-            *entry_offset_byte_rtn = char_offset - cursor;
-            return entry;
-        } else { // need to look further
-            cursor += entry->size;
-        }
+    if (char_offset >= aesd_circular_buffer_size(buffer))
+        return NULL;
+    // the entry is the last one starting at or before char_offset: binary search
+    // over the start offsets, which grow from the oldest entry to the newest
+    while (hi - lo > 1) {
+        mid = lo + (hi - lo) / 2;
+        if (aesd_circular_buffer_entry_fpos(buffer, aesd_circular_buffer_get_entry(buffer, mid)) <=
+            char_offset)
+            lo = mid;
+        else
+            hi = mid;
     }
-    return NULL;
+    entry = aesd_circular_buffer_get_entry(buffer, lo);
+    *entry_offset_byte_rtn = char_offset - aesd_circular_buffer_entry_fpos(buffer, entry);
+    return entry;
 }
 
 /**
@@ -64,16 +65,17 @@ struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(
 void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer,
                                     const struct aesd_buffer_entry *add_entry) {
 
-    // push data to buffer
+    // push data to buffer, right after the newest entry
     buffer->entry[buffer->in_offs] = *add_entry;
+    buffer->entry[buffer->in_offs].offset = buffer->end_offset;
+    buffer->end_offset += add_entry->size;
     // update the input offset for the next entry addition
-    buffer->in_offs =
-        (buffer->in_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    buffer->in_offs = (buffer->in_offs + 1) % buffer->depth;
 
     // if the buffer is full also move the output offset index
     if (buffer->full) {
-        buffer->out_offs =
-            (buffer->out_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+        buffer->out_offs = (buffer->out_offs + 1) % buffer->depth;
+        buffer->first_offset = buffer->entry[buffer->out_offs].offset;
     }
 
     // if full also update the out_off
@@ -82,7 +84,84 @@ void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer,
 
 /**
  * Initializes the circular buffer described by @param buffer to an empty struct
+ * of AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED entries
  */
 void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer) {
     memset(buffer, 0, sizeof(struct aesd_circular_buffer));
+    buffer->entry = buffer->default_entry;
+    buffer->depth = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+}
+
+/**
+ * @return the number of entries stored in @param buffer
+ */
+uint32_t aesd_circular_buffer_count(const struct aesd_circular_buffer *buffer) {
+    if (buffer->full)
+        return buffer->depth;
+    return (buffer->in_offs + buffer->depth - buffer->out_offs) % buffer->depth;
+}
+
+/**
+ * @return the entry @param index of @param buffer, counted from the oldest one,
+ * or NULL if the buffer holds no such entry
+ */
+struct aesd_buffer_entry *aesd_circular_buffer_get_entry(struct aesd_circular_buffer *buffer,
+                                                         uint32_t index) {
+    if (index >= aesd_circular_buffer_count(buffer))
+        return NULL;
+    return &buffer->entry[(buffer->out_offs + index) % buffer->depth];
+}
+
+/**
+ * Removes the oldest entry of @param buffer and stores it in @param removed,
+ * its buffptr is then for the caller to free. Any necessary locking must be
+ * handled by the caller.
+ * @return false if the buffer is empty.
+ */
+bool aesd_circular_buffer_remove_oldest(struct aesd_circular_buffer *buffer,
+                                        struct aesd_buffer_entry *removed) {
+
+    if (!aesd_circular_buffer_count(buffer))
+        return false;
+    *removed = buffer->entry[buffer->out_offs];
+    memset(&buffer->entry[buffer->out_offs], 0, sizeof(struct aesd_buffer_entry));
+    buffer->out_offs = (buffer->out_offs + 1) % buffer->depth;
+    buffer->full = false;
+    buffer->first_offset += removed->size;
+    return true;
+}
+
+/**
+ * Moves the entries of @param buffer to @param entries, an array of @param depth
+ * entries allocated by the caller, or to buffer->default_entry when @param
+ * entries is NULL (depth must then be AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED).
+ * The entries are kept in order, the oldest one first. The caller removes the
+ * oldest entries that don't fit in depth beforehand (see
+ * aesd_circular_buffer_remove_oldest()). Any necessary locking must be handled
+ * by the caller.
+ * @return the previous entry array, for the caller to free unless it is
+ * buffer->default_entry.
+ */
+struct aesd_buffer_entry *aesd_circular_buffer_resize(struct aesd_circular_buffer *buffer,
+                                                      struct aesd_buffer_entry *entries,
+                                                      uint32_t depth) {
+
+    struct aesd_buffer_entry *previous = buffer->entry;
+    uint32_t count = aesd_circular_buffer_count(buffer), i;
+
+    if (!entries) {
+        entries = buffer->default_entry;
+        depth = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    }
+    if (entries == previous) // already in the default array
+        return previous;
+    memset(entries, 0, depth * sizeof(struct aesd_buffer_entry));
+    for (i = 0; i < count; i++)
+        entries[i] = previous[(buffer->out_offs + i) % buffer->depth];
+    buffer->entry = entries;
+    buffer->depth = depth;
+    buffer->out_offs = 0;
+    buffer->in_offs = count % depth;
+    buffer->full = (count == depth);
+    return previous;
 }
@@ -26,17 +26,63 @@
 #endif
 
 #include <linux/mutex.h>
+#include <linux/seqlock.h>
+#include <linux/rcupdate.h>
+#include <linux/refcount.h>
 
+// bytes of a chunk of entry data (struct aesd_chunk), header included
+#define AESD_CHUNK_SIZE 512
+
+/**
+ * The memory of an entry of the history: its data is stored in fixed-size chunks allocated from
+ * a dedicated cache, chained in order, and buffptr of the entry points to the data of the first
+ * one. Readers hold a reference on the first chunk while they copy the entry, the writer that
+ * evicts the entry drops the buffer's one and the chunks are freed after an RCU grace period
+ * once the last reference is gone.
+ */
+struct aesd_chunk {
+    struct aesd_chunk *next; /* next chunk of the entry, NULL for the last one */
+    refcount_t refs;         /* references on the whole entry, in its first chunk only */
+    struct rcu_head rcu;
+    char data[];
+};
+
+#define AESD_CHUNK_DATA (AESD_CHUNK_SIZE - sizeof(struct aesd_chunk))
+
+/**
+ * A write command not terminated by a new line yet, in chunks filled in order
+ */
+struct aesd_pending {
+    struct aesd_chunk *head; /* first chunk, NULL if nothing is pending */
+    struct aesd_chunk *tail; /* last chunk */
+    size_t size;             /* bytes of the chunks in use */
+};
 
 struct aesd_dev {
     int major;
     int minor;
-    int opened;
-    int pending_write;
-    struct mutex buffer_lock;
+    struct mutex buffer_lock; /* serializes the writers of buffer */
+    seqcount_mutex_t seq;     /* lets readers find entries in buffer without buffer_lock */
     struct aesd_circular_buffer buffer;
-    struct aesd_buffer_entry pending_entry;
+    uint64_t entries_written;     /* write commands ever added to buffer */
+    struct aesd_mmap_header *map; /* read-only mapping (aesd_ioctl.h), set by the first mmap() */
+    struct mutex pending_lock;    /* protects pending */
+    struct aesd_pending pending;  /* left unterminated by a closed file, for the next write */
     struct cdev cdev; /* Char device structure      */
 };
 
+/**
+ * State of an open file of the device, so that any number of them can write concurrently
+ */
+struct aesd_file {
+    struct aesd_dev *dev;
+    struct mutex lock;           /* serializes the writes, and the reads, through this file */
+    struct aesd_pending pending; /* write command not terminated by a new line yet */
+    /* chunk where the last read stopped, so that reading an entry in small pieces doesn't walk
+     * its chunks from the first one every time */
+    const struct aesd_chunk *cursor; /* NULL if there is none */
+    size_t cursor_entry;             /* stream offset of its entry (aesd_buffer_entry.offset) */
+    size_t cursor_start;             /* offset of its first byte in the entry */
+};
+
 #endif /* AESD_CHAR_DRIVER_AESDCHAR_H_ */
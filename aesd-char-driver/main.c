@@ -21,12 +21,198 @@
 #include "aesdchar.h"
 #include "aesd_ioctl.h"
 #include <linux/slab.h>
+#include <linux/mm.h> // kvcalloc
+#include <linux/rcupdate.h>
+#include <linux/seqlock.h>
+#include <linux/vmalloc.h>
+#include <linux/version.h>
 
 MODULE_AUTHOR("Zakaria Madaoui");
 MODULE_LICENSE("Dual BSD/GPL");
 
+static unsigned int depth = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+module_param(depth, uint, 0444);
+MODULE_PARM_DESC(depth, "number of write commands kept in the history (AESDCHAR_IOCSETDEPTH)");
+
+static unsigned int map_kb = 1024;
+module_param(map_kb, uint, 0444);
+MODULE_PARM_DESC(map_kb, "size in KiB of the data ring of the read-only mapping (mmap)");
+
 struct aesd_dev aesd_device;
-DEFINE_MUTEX(access_control);
+
+// largest write command
+#define AESD_RECORD_MAX KMALLOC_MAX_SIZE
+
+static struct kmem_cache *aesd_chunk_cache; // chunks of entry data, see struct aesd_chunk
+
+/**
+ * @return the first chunk of the entry data @param buffptr
+ */
+static struct aesd_chunk *aesd_record_of(const char *buffptr) {
+    return (struct aesd_chunk *)(buffptr - offsetof(struct aesd_chunk, data));
+}
+
+/**
+ * @return the chunk of the entry data @param buffptr holding its byte @param offset, which is
+ * set to the offset of that byte in the chunk.
+ */
+static const struct aesd_chunk *aesd_chunk_at(const char *buffptr, size_t *offset) {
+    const struct aesd_chunk *chunk = aesd_record_of(buffptr);
+    for (; *offset >= AESD_CHUNK_DATA; *offset -= AESD_CHUNK_DATA)
+        chunk = chunk->next;
+    return chunk;
+}
+
+/**
+ * @return the chunk of @param entry holding its byte @param offset, like aesd_chunk_at(), but
+ * starting from the read cursor of @param file when it is on the same entry and not past that
+ * byte. The caller holds a reference on the entry: entries have unique stream offsets, so the
+ * cursor chunk of an entry with that offset is still allocated.
+ */
+static const struct aesd_chunk *aesd_cursor_chunk_at(const struct aesd_file *file,
+                                                     const struct aesd_buffer_entry *entry,
+                                                     size_t *offset) {
+    const struct aesd_chunk *chunk = file->cursor;
+    if (!chunk || file->cursor_entry != entry->offset || file->cursor_start > *offset)
+        return aesd_chunk_at(entry->buffptr, offset);
+    for (*offset -= file->cursor_start; *offset >= AESD_CHUNK_DATA; *offset -= AESD_CHUNK_DATA)
+        chunk = chunk->next;
+    return chunk;
+}
+
+/**
+ * Frees the chain of chunks @param chunk.
+ */
+static void aesd_chunks_free(struct aesd_chunk *chunk) {
+    while (chunk) {
+        struct aesd_chunk *next = chunk->next;
+        kmem_cache_free(aesd_chunk_cache, chunk);
+        chunk = next;
+    }
+}
+
+static void aesd_record_free_rcu(struct rcu_head *rcu) {
+    aesd_chunks_free(container_of(rcu, struct aesd_chunk, rcu));
+}
+
+/**
+ * Drops a reference on the entry data @param buffptr, freeing its chunks once no reader can
+ * still be looking at them.
+ */
+static void aesd_record_put(const char *buffptr) {
+    struct aesd_chunk *record = aesd_record_of(buffptr);
+    if (refcount_dec_and_test(&record->refs))
+        call_rcu(&record->rcu, aesd_record_free_rcu);
+}
+
+/**
+ * Appends @param count bytes to @param pending, from the user buffer @param ubuf or, if it is
+ * NULL, from @param kbuf. New chunks are chained as the last one fills up: what was appended
+ * before is never copied again.
+ * @param faulted: set if the user buffer can't be read, may be NULL with @param kbuf.
+ * @return the number of bytes appended, less than @param count if the user buffer faulted or a
+ * chunk can't be allocated.
+ */
+static size_t aesd_pending_append(struct aesd_pending *pending, const char __user *ubuf,
+                                  const char *kbuf, size_t count, bool *faulted) {
+    size_t written = 0, not_copied = 0;
+
+    while (written < count && !not_copied) {
+        size_t chunk_offset = pending->size % AESD_CHUNK_DATA;
+        struct aesd_chunk *chunk = pending->tail;
+        size_t bytes = min(count - written, AESD_CHUNK_DATA - chunk_offset);
+
+        if (chunk_offset == 0) { // the last chunk is full, or there is none
+            chunk = kmem_cache_alloc(aesd_chunk_cache, GFP_KERNEL);
+            if (!chunk)
+                break;
+            chunk->next = NULL;
+        }
+        if (ubuf)
+            not_copied = copy_from_user(chunk->data + chunk_offset, ubuf + written, bytes);
+        else
+            memcpy(chunk->data + chunk_offset, kbuf + written, bytes);
+        if (not_copied == bytes && chunk != pending->tail) {
+            kmem_cache_free(aesd_chunk_cache, chunk); // nothing to chain
+            break;
+        }
+        if (chunk != pending->tail) {
+            if (pending->head)
+                pending->tail->next = chunk;
+            else
+                pending->head = chunk;
+            pending->tail = chunk;
+        }
+        written += bytes - not_copied;
+        pending->size += bytes - not_copied;
+    }
+    if (faulted)
+        *faulted = not_copied != 0;
+    return written;
+}
+
+/**
+ * Hands the unterminated write command @param pending of a file being closed over to
+ * @param dev, for the next write of any file to complete it, as if every write went to the
+ * device as a whole: "echo -n foo; echo bar" still stores "foobar\n". It goes after what an
+ * earlier closed file left there.
+ */
+static void aesd_pending_leave(struct aesd_dev *dev, struct aesd_pending *pending) {
+    const struct aesd_chunk *chunk;
+    size_t left = pending->size;
+
+    mutex_lock(&dev->pending_lock);
+    if (!dev->pending.head) {
+        WRITE_ONCE(dev->pending.head, pending->head);
+        dev->pending.tail = pending->tail;
+        dev->pending.size = pending->size;
+        mutex_unlock(&dev->pending_lock);
+        return;
+    }
+    for (chunk = pending->head; chunk && left; chunk = chunk->next) {
+        size_t bytes = min(left, AESD_CHUNK_DATA);
+        bytes = min(bytes, AESD_RECORD_MAX - dev->pending.size);
+        if (aesd_pending_append(&dev->pending, NULL, chunk->data, bytes, NULL) != bytes)
+            break;
+        left -= bytes;
+    }
+    mutex_unlock(&dev->pending_lock);
+    if (left)
+        printk(KERN_ERR "aesdchar: dropped %zu bytes of an unterminated write\n", left);
+    aesd_chunks_free(pending->head);
+}
+
+/**
+ * Moves the write command left unterminated by a closed file of @param dev, if any, to the
+ * empty @param pending of a file about to write.
+ */
+static void aesd_pending_adopt(struct aesd_dev *dev, struct aesd_pending *pending) {
+    if (!READ_ONCE(dev->pending.head)) // nothing left, don't contend on the lock
+        return;
+    mutex_lock(&dev->pending_lock);
+    *pending = dev->pending;
+    WRITE_ONCE(dev->pending.head, NULL);
+    dev->pending.tail = NULL;
+    dev->pending.size = 0;
+    mutex_unlock(&dev->pending_lock);
+}
+
+/**
+ * Copies @param size bytes of the data of @param entry, from its byte @param offset, to
+ * @param to.
+ */
+static void aesd_entry_copy(char *to, const struct aesd_buffer_entry *entry, size_t offset,
+                            size_t size) {
+    const struct aesd_chunk *chunk = aesd_chunk_at(entry->buffptr, &offset);
+    while (size) {
+        size_t bytes = min(size, AESD_CHUNK_DATA - offset);
+        memcpy(to, chunk->data + offset, bytes);
+        to += bytes;
+        size -= bytes;
+        chunk = chunk->next;
+        offset = 0;
+    }
+}
 
 /**
  * initializes the AESD specific portion of the device
@@ -34,213 +220,372 @@ DEFINE_MUTEX(access_control);
 void aesd_dev_init(struct aesd_dev *dev) {
     memset(dev, 0, sizeof(struct aesd_dev));
     mutex_init(&dev->buffer_lock); // init the mutex for locking the buffer
-    // allocate a buffer for pending operations
-    dev->pending_entry.buffptr = (char *)kmalloc(KMALLOC_MAX_SIZE, GFP_KERNEL);
+    seqcount_mutex_init(&dev->seq, &dev->buffer_lock);
+    mutex_init(&dev->pending_lock);
+    aesd_circular_buffer_init(&dev->buffer);
 }
 
 /**
  * cleans up the AESD specific portion of the device
  */
 void aesd_dev_cleanup(struct aesd_dev *dev) {
-    uint8_t index;
+    uint32_t index;
     struct aesd_buffer_entry *entry;
     AESD_CIRCULAR_BUFFER_FOREACH(entry, &dev->buffer, index) {
         if (entry->buffptr != NULL)
-            kfree(entry->buffptr);
+            aesd_record_put(entry->buffptr);
     }
-    if (dev->pending_entry.buffptr != NULL)
-        kfree(dev->pending_entry.buffptr);
+    aesd_chunks_free(dev->pending.head);
+    rcu_barrier(); // wait for the records freed by call_rcu()
+    if (dev->buffer.entry != dev->buffer.default_entry)
+        kvfree(dev->buffer.entry);
+    vfree(dev->map);
 }
 
-int aesd_open(struct inode *inode, struct file *filp) {
-    PDEBUG("open");
+/**
+ * Moves the history described by the mapping of @param dev forward to the current one of its
+ * buffer. Must be called with buffer_lock held and the mapping generation odd.
+ * @param end: stream offset the data ring is about to be written up to.
+ */
+static void aesd_map_advance(struct aesd_dev *dev, size_t end) {
+    struct aesd_mmap_header *header = dev->map;
+    size_t data_size = header->data_size, first = header->first_offset, entry_offset;
+    struct aesd_buffer_entry *entry;
 
-    struct aesd_dev *dev;                                     /* device information */
-    dev = container_of(inode->i_cdev, struct aesd_dev, cdev); /*  Find the device */
-    filp->private_data = dev; /* and use filp->private_data to point to the device data */
+    // nothing older than the oldest write command kept
+    if ((ssize_t)(dev->buffer.first_offset - first) > 0)
+        first = dev->buffer.first_offset;
+    // nor what the data ring can't hold any more: the oldest command left starts after end -
+    // data_size, if a single command is larger than the ring the mapping holds nothing
+    if (end - first > data_size) {
+        entry = aesd_circular_buffer_find_entry_offset_for_fpos(
+            &dev->buffer, end - data_size - dev->buffer.first_offset, &entry_offset);
+        first = entry ? entry->offset + (entry_offset ? entry->size : 0) : end;
+        if ((ssize_t)(first - end) > 0)
+            first = end;
+    }
+    WRITE_ONCE(header->history_offset, dev->buffer.first_offset);
+    WRITE_ONCE(header->first_offset, first);
+    smp_wmb(); // consumers see first_offset move before the data it covered is overwritten
+}
 
-    mutex_lock(&access_control); // only one process can open this at a time
-    if (dev->opened)
-        return -EBUSY;
-    dev->opened = 1;
-    mutex_unlock(&access_control);
-    return 0;
+/**
+ * Copies the newest write command @param entry of @param dev, number @param number, to the data
+ * ring of its mapping and publishes it. Must be called with buffer_lock held.
+ */
+static void aesd_map_entry(struct aesd_dev *dev, const struct aesd_buffer_entry *entry,
+                           uint64_t number) {
+    struct aesd_mmap_header *header = dev->map;
+    size_t data_size = header->data_size, end = entry->offset + entry->size;
+    char *data = (char *)header + AESD_MMAP_HEADER_SIZE;
+
+    WRITE_ONCE(header->generation, header->generation + 1);
+    smp_wmb();
+    aesd_map_advance(dev, end);
+    if (entry->size <= data_size) { // in one or two pieces, around the end of the ring
+        size_t pos = entry->offset % data_size;
+        size_t first_part = min(entry->size, data_size - pos);
+        aesd_entry_copy(data + pos, entry, 0, first_part);
+        aesd_entry_copy(data, entry, first_part, entry->size - first_part);
+    }
+    header->entries[number % header->entry_slots].offset = entry->offset;
+    header->entries[number % header->entry_slots].size = entry->size;
+    WRITE_ONCE(header->entries_written, number + 1);
+    WRITE_ONCE(header->end_offset, end);
+    smp_wmb();
+    WRITE_ONCE(header->generation, header->generation + 1);
 }
 
-int aesd_close(struct inode *inode, struct file *filp) {
-    PDEBUG("release");
+/**
+ * Publishes to the mapping of @param dev that its oldest write commands were dropped. Must be
+ * called with buffer_lock held.
+ */
+static void aesd_map_history(struct aesd_dev *dev) {
+    struct aesd_mmap_header *header = dev->map;
+
+    WRITE_ONCE(header->generation, header->generation + 1);
+    smp_wmb();
+    aesd_map_advance(dev, header->end_offset);
+    smp_wmb();
+    WRITE_ONCE(header->generation, header->generation + 1);
+}
 
-    struct aesd_dev *dev;                                     /* device information */
-    dev = container_of(inode->i_cdev, struct aesd_dev, cdev); /*  Find the device */
+/**
+ * Allocates the mapping of @param dev on its first mmap() and fills it with the write commands
+ * kept so far. The writers keep it up to date from then on.
+ * @return 0 on success, a negative errno otherwise.
+ */
+static int aesd_map_alloc(struct aesd_dev *dev) {
+    size_t data_size = PAGE_ALIGN((size_t)map_kb * 1024);
+    struct aesd_mmap_header *header;
+    uint32_t index, count;
+
+    if (READ_ONCE(dev->map))
+        return 0;
+    if (data_size == 0)
+        return -ENODEV;
+    header = vmalloc_user(AESD_MMAP_HEADER_SIZE + data_size); // zeroed
+    if (!header)
+        return -ENOMEM;
+    header->magic = AESD_MMAP_MAGIC;
+    header->entry_slots = (AESD_MMAP_HEADER_SIZE - sizeof(struct aesd_mmap_header)) /
+                          sizeof(struct aesd_mmap_entry);
+    header->data_size = data_size;
 
-    mutex_lock(&access_control);
-    dev->opened = 0;
-    mutex_unlock(&access_control);
+    mutex_lock(&dev->buffer_lock);
+    if (dev->map) { // another mmap() got there first
+        mutex_unlock(&dev->buffer_lock);
+        vfree(header);
+        return 0;
+    }
+    dev->map = header;
+    header->first_offset = header->end_offset = dev->buffer.first_offset;
+    count = aesd_circular_buffer_count(&dev->buffer);
+    for (index = 0; index < count; index++)
+        aesd_map_entry(dev, aesd_circular_buffer_get_entry(&dev->buffer, index),
+                       dev->entries_written - count + index);
+    mutex_unlock(&dev->buffer_lock);
     return 0;
 }
 
-ssize_t aesd_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos) {
-    PDEBUG("read %zu bytes with offset %lld, while other fpos is  %lld", count, *f_pos, filp->f_pos);
-    struct aesd_dev *dev = filp->private_data;
+/**
+ * Maps the history read-only (see struct aesd_mmap_header) so that it can be replayed without
+ * any read() or copy.
+ */
+int aesd_mmap(struct file *filp, struct vm_area_struct *vma) {
+    struct aesd_file *file = filp->private_data;
+    int ret;
 
-    // not allowed to read/write if not already open
-    mutex_lock_interruptible(&access_control);
-    if (!dev->opened) {
-        mutex_unlock(&access_control);
+    if (vma->vm_flags & VM_WRITE)
         return -EPERM;
-    }
-    mutex_unlock(&access_control);
-
-    ssize_t result = count;
-    mutex_lock_interruptible(&dev->buffer_lock); // lock the buffer mutex before read
-    struct aesd_circular_buffer *circ_buff = &dev->buffer;
-    // find the entry where f_pos is pointing to
-    size_t r_pos = 0;
-    struct aesd_buffer_entry *fpos_entry =
-        aesd_circular_buffer_find_entry_offset_for_fpos(circ_buff, *f_pos, &r_pos);
-    if (!fpos_entry) {
-        result = 0;
-        goto read_end;
-    }
-    size_t fpos_entry_idx = fpos_entry - circ_buff->entry; // find index in the buffer
-
-    // Read from the entry index until end of the buffer, respecting the count
-    size_t bytes_written = 0;
-    char __user *write_ptr = buf;
-    size_t buffer_end = circ_buff->in_offs;
-    struct aesd_buffer_entry current_entry;
-
-    size_t i = fpos_entry_idx;
-    do {
-        current_entry = circ_buff->entry[i];
-        PDEBUG("reading entry at index %zu, buffent_end %zu", i, buffer_end);
-        if (current_entry.size == 0 || bytes_written >= count)
-            break; // quit if the history entry is empty
-
-        size_t bytes_to_write = min(count - bytes_written, current_entry.size - r_pos);
-        char *history_entry = current_entry.buffptr;
-        if (r_pos != 0) {
-            history_entry += r_pos;
-            r_pos = 0;
-        }
-        size_t not_written = copy_to_user(write_ptr, history_entry, bytes_to_write);
-        if (not_written)
-            printk(KERN_ERR "aesdchar: failed to write %zu bytes to userspace\n", not_written);
-        write_ptr += bytes_to_write; // Advance the write pointer
-        bytes_written +=
-            bytes_to_write - not_written; // Increment the total number of bytes written
-
-        i = (i + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-    } while ((i != buffer_end) || (bytes_written >= count));
-
-    result = bytes_written;
-    *f_pos +=
-        bytes_written; // update fpos so that next time we continue reading from the same position
-
-read_end:
-    mutex_unlock(&dev->buffer_lock); // unlock the buffer mutex after read operation
-    return result;
+    ret = aesd_map_alloc(file->dev);
+    if (ret)
+        return ret;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_clear(vma, VM_MAYWRITE);
+#else
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+    return remap_vmalloc_range(vma, file->dev->map, vma->vm_pgoff);
 }
 
-ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos) {
-    PDEBUG("write %zu bytes with offset %lld", count, *f_pos);
-
-    struct aesd_dev *dev = filp->private_data;
+/**
+ * Copies the fields of the buffer of @param dev that locate entries to @param snapshot, for a
+ * reader that doesn't hold buffer_lock. The snapshot is consistent (the entry array matches the
+ * depth) if read_seqcount_retry() on the returned sequence is false, its entries may be
+ * overwritten meanwhile though: whatever is read from them must be checked again. Must be
+ * called under rcu_read_lock(), which keeps a replaced entry array around.
+ */
+static unsigned int aesd_snapshot(struct aesd_dev *dev, struct aesd_circular_buffer *snapshot) {
+    unsigned int seq = read_seqcount_begin(&dev->seq);
+    snapshot->entry = READ_ONCE(dev->buffer.entry);
+    snapshot->depth = READ_ONCE(dev->buffer.depth);
+    snapshot->in_offs = READ_ONCE(dev->buffer.in_offs);
+    snapshot->out_offs = READ_ONCE(dev->buffer.out_offs);
+    snapshot->full = READ_ONCE(dev->buffer.full);
+    snapshot->first_offset = READ_ONCE(dev->buffer.first_offset);
+    snapshot->end_offset = READ_ONCE(dev->buffer.end_offset);
+    return seq;
+}
 
-    // not allowed to read/write if not already open
-    mutex_lock_interruptible(&access_control);
-    if (!dev->opened) {
-        mutex_unlock(&access_control);
-        return -EPERM;
+/**
+ * Finds the entry of @param dev holding char offset @param pos without taking buffer_lock, and
+ * takes a reference on its data for the caller to drop with aesd_record_put().
+ * @param stream_pos: if not NULL, the offset to find in everything ever written instead of pos
+ * (see aesd_buffer_entry.offset), which doesn't move as the oldest entries are evicted.
+ * @param entry: set to a copy of the entry.
+ * @param entry_offset: set to the offset of the position in the entry.
+ * @return false if the position is not available in the buffer (any more).
+ */
+static bool aesd_get_entry(struct aesd_dev *dev, loff_t pos, const size_t *stream_pos,
+                           struct aesd_buffer_entry *entry, size_t *entry_offset) {
+    struct aesd_circular_buffer snapshot;
+    struct aesd_buffer_entry *found;
+    unsigned int seq;
+
+    if (pos < 0)
+        return false;
+    rcu_read_lock();
+    for (;;) {
+        seq = aesd_snapshot(dev, &snapshot);
+        if (read_seqcount_retry(&dev->seq, seq))
+            continue;
+        if (stream_pos) {
+            pos = *stream_pos - snapshot.first_offset;
+            if ((ssize_t)pos < 0) { // evicted
+                found = NULL;
+                break;
+            }
+        }
+        found = aesd_circular_buffer_find_entry_offset_for_fpos(&snapshot, pos, entry_offset);
+        if (found)
+            *entry = *found;
+        if (read_seqcount_retry(&dev->seq, seq))
+            continue; // an entry was added or evicted meanwhile
+        // the record can't be freed before rcu_read_unlock(), but it may have been evicted
+        // since the check above: look again then
+        if (!found || refcount_inc_not_zero(&aesd_record_of(entry->buffptr)->refs))
+            break;
     }
-    mutex_unlock(&access_control);
+    rcu_read_unlock();
+    return found != NULL;
+}
 
-    // adjust the count to the maximum allocatable size
-    count = (count > KMALLOC_MAX_SIZE) ? KMALLOC_MAX_SIZE : count;
+int aesd_open(struct inode *inode, struct file *filp) {
+    PDEBUG("open");
 
-    // allocate some memory for reading user data
-    char *user_data = (char *)kmalloc(count, GFP_KERNEL);
-    if (!user_data) {
+    struct aesd_file *file = kzalloc(sizeof(struct aesd_file), GFP_KERNEL);
+    if (!file)
         return -ENOMEM;
-    }
+    file->dev = container_of(inode->i_cdev, struct aesd_dev, cdev); /*  Find the device */
+    mutex_init(&file->lock);
+    filp->private_data = file; /* any number of files may be open, each with its own state */
+    return 0;
+}
 
-    // copy the user written data into the allocated memory location
-    size_t not_copied = copy_from_user((void *)user_data, buf, count);
-    if (not_copied) {
-        printk(KERN_ERR "aesdchar: filed to copy %zu bytes to kernelspace", not_copied);
-        count -= not_copied;
-    }
+int aesd_close(struct inode *inode, struct file *filp) {
+    PDEBUG("release");
 
-    // Before modifying the circular buffer, first we aquire the lock to access it
-    mutex_lock_interruptible(&dev->buffer_lock);
-    struct aesd_circular_buffer *circ_buff = &dev->buffer;
+    struct aesd_file *file = filp->private_data;
+    if (file->pending.head) // completed by the next write to the device
+        aesd_pending_leave(file->dev, &file->pending);
+    kfree(file);
+    return 0;
+}
 
-    // adjust `count` if a pending operation is detected to fit our write capacity
-    if (dev->pending_write || user_data[count - 1] != '\n') {
-        int enough_room = (KMALLOC_MAX_SIZE - dev->pending_entry.size) >= count;
-        count = enough_room ? count : (KMALLOC_MAX_SIZE - dev->pending_entry.size);
+ssize_t aesd_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos) {
+    PDEBUG("read %zu bytes with offset %lld, while other fpos is  %lld", count, *f_pos, filp->f_pos);
+    struct aesd_file *file = filp->private_data;
+    struct aesd_buffer_entry entry;
+    size_t entry_offset, stream_pos, bytes_read = 0;
+
+    if (mutex_lock_interruptible(&file->lock)) // the read cursor
+        return -ERESTARTSYS;
+
+    // readers don't take buffer_lock: every entry is looked up lock-free and kept alive by a
+    // reference while it is copied, so readers of different files never wait for each other nor
+    // for the writers.
+    // After the first entry, the read goes on from where that one ends in the stream, so that
+    // it stays contiguous while writers evict the oldest entries.
+    while (bytes_read < count && aesd_get_entry(file->dev, *f_pos, bytes_read ? &stream_pos : NULL,
+                                                &entry, &entry_offset)) {
+        size_t bytes_to_read = min(count - bytes_read, entry.size - entry_offset);
+        size_t chunk_offset = entry_offset, left = bytes_to_read, not_copied = 0;
+        const struct aesd_chunk *chunk = aesd_cursor_chunk_at(file, &entry, &chunk_offset);
+        size_t chunk_start = entry_offset - chunk_offset;
+        // chunk by chunk, from the one holding entry_offset
+        while (left && !not_copied) {
+            size_t bytes = min(left, AESD_CHUNK_DATA - chunk_offset);
+            not_copied = copy_to_user(buf + bytes_read + bytes_to_read - left,
+                                      chunk->data + chunk_offset, bytes);
+            left -= bytes;
+            if (left) {
+                chunk = chunk->next;
+                chunk_start += AESD_CHUNK_DATA;
+                chunk_offset = 0;
+            }
+        }
+        not_copied += left;
+        // the next read most likely goes on from the last chunk copied
+        file->cursor = chunk;
+        file->cursor_entry = entry.offset;
+        file->cursor_start = chunk_start;
+        aesd_record_put(entry.buffptr);
+        stream_pos = entry.offset + entry_offset + bytes_to_read;
+        bytes_read += bytes_to_read - not_copied;
+        *f_pos += bytes_to_read - not_copied; // continue from there next time
+        if (not_copied) {
+            printk(KERN_ERR "aesdchar: failed to write %zu bytes to userspace\n", not_copied);
+            mutex_unlock(&file->lock);
+            return bytes_read ? bytes_read : -EFAULT;
+        }
     }
-    ssize_t result = count;
-
-    // new line not found at the end of the user write command
-    if (user_data[count - 1] != '\n') {
-        PDEBUG("No, new line found in this input, pending this data...");
-
-        dev->pending_write = 1;
+    mutex_unlock(&file->lock);
+    return bytes_read;
+}
 
-        // Copy the user_data into the pending buffer which has a larger capacity
-        const char *copy_to = dev->pending_entry.buffptr + dev->pending_entry.size;
-        memcpy((void *)copy_to, (void *)user_data, count);
-        dev->pending_entry.size += count;
-        kfree(user_data);
-        goto write_out;
+/**
+ * Appends @param count bytes of @param buf to the pending write command of @param file, and adds
+ * it to the history once it ends with a new line. Must be called with the lock of the file held.
+ */
+static ssize_t aesd_file_write(struct aesd_file *file, const char __user *buf, size_t count) {
+    struct aesd_dev *dev = file->dev;
+    size_t written;
+    bool faulted;
+
+    if (!file->pending.head)
+        aesd_pending_adopt(dev, &file->pending);
+    // adjust the count to the room left in the largest record
+    count = min(count, AESD_RECORD_MAX - file->pending.size);
+    if (count == 0)
+        return -ENOSPC;
+
+    // append the user data to the pending chunks of this file
+    written = aesd_pending_append(&file->pending, buf, NULL, count, &faulted);
+    if (written < count) {
+        if (faulted)
+            printk(KERN_ERR "aesdchar: filed to copy %zu bytes to kernelspace", count - written);
+        if (written == 0)
+            return faulted ? -EFAULT : -ENOMEM;
     }
+    count = written;
 
-    struct aesd_buffer_entry entry;
-    // new line found, but behavior will depend based on whether there is a pending write or not
-    if (dev->pending_write) { // finish a pending operation
-        PDEBUG("New line char found, finishing the previous pending operation...");
-
-        // initialize the entry size and buffer
-        entry.size = count + dev->pending_entry.size;
-        char *buffptr = (char *)kmalloc(entry.size, GFP_KERNEL);
-        entry.buffptr = buffptr;
-
-        // copy the data to the buffer
-        memcpy(buffptr, dev->pending_entry.buffptr, dev->pending_entry.size);
-        memcpy(buffptr + dev->pending_entry.size, user_data, count);
-
-        // free the allocated `user_data` as we don't use it anymore
-        kfree(user_data);
-
-        // reset the size of the pending buffer and disable the pending flag
-        dev->pending_entry.size = 0;
-        dev->pending_write = 0;
-    }
-    // whatever came from userspace, it got immediatly saved to the buffer
-    else {
-        PDEBUG("Input provided in correct format, inserting immdiately to the buffer...");
-        entry.buffptr = user_data;
-        entry.size = count;
+    // new line not found at the end of the user write command
+    if (file->pending.tail->data[(file->pending.size - 1) % AESD_CHUNK_DATA] != '\n') {
+        PDEBUG("No, new line found in this input, pending this data...");
+        return count;
     }
 
-    // insert the entry to the cicular buffer
-    if (circ_buff->full) {
-        // if the buffer is full, first de-allocate the old history line we are about to overwrite
+    struct aesd_buffer_entry entry = {.buffptr = file->pending.head->data,
+                                      .size = file->pending.size};
+    refcount_set(&file->pending.head->refs, 1); // the buffer's reference
+    file->pending.head = file->pending.tail = NULL;
+    file->pending.size = 0;
+
+    // insert the entry to the cicular buffer, the readers see it (or the evicted one) go once
+    // the sequence count is released
+    const char *evicted = NULL;
+    mutex_lock(&dev->buffer_lock);
+    write_seqcount_begin(&dev->seq);
+    if (dev->buffer.full) {
         PDEBUG("Buffer is full, deleting the oldest entry");
-        kfree(circ_buff->entry[circ_buff->in_offs].buffptr);
-        circ_buff->entry[circ_buff->in_offs].size = 0;
+        evicted = dev->buffer.entry[dev->buffer.in_offs].buffptr;
     }
-    aesd_circular_buffer_add_entry(circ_buff, &entry);
-
-write_out:
+    aesd_circular_buffer_add_entry(&dev->buffer, &entry);
+    dev->entries_written++;
+    write_seqcount_end(&dev->seq);
+    if (dev->map) // the entry just added is the newest one
+        aesd_map_entry(dev,
+                       aesd_circular_buffer_get_entry(&dev->buffer,
+                                                      aesd_circular_buffer_count(&dev->buffer) - 1),
+                       dev->entries_written - 1);
     mutex_unlock(&dev->buffer_lock);
-    return result;
+    if (evicted)
+        aesd_record_put(evicted); // readers copying it keep it alive
+    return count;
+}
+
+ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos) {
+    PDEBUG("write %zu bytes with offset %lld", count, *f_pos);
+
+    struct aesd_file *file = filp->private_data;
+    ssize_t ret;
+
+    if (count == 0) // nothing to append, whatever room is left
+        return 0;
+    // threads sharing the file (or a forked descriptor) append to the same pending command
+    if (mutex_lock_interruptible(&file->lock))
+        return -ERESTARTSYS;
+    ret = aesd_file_write(file, buf, count);
+    mutex_unlock(&file->lock);
+    return ret;
 }
 
 loff_t aesd_llseek(struct file *filp, loff_t off, int whence) {
-    struct aesd_dev *dev = filp->private_data;
-    long newpos = 0;
+    struct aesd_file *file = filp->private_data;
+    struct aesd_circular_buffer snapshot;
+    unsigned int seq;
+    loff_t newpos = 0;
     char *mode[] = {"SEEK_SET", "SEEK_CUR", "SEEK_END"};
     PDEBUG("llseek: mode: %s, off: %lld", mode[whence], off);
 
@@ -254,16 +599,12 @@ loff_t aesd_llseek(struct file *filp, loff_t off, int whence) {
         break;
 
     case SEEK_END:
-
-        uint8_t index;
-        struct aesd_buffer_entry *entry;
-        mutex_lock_interruptible(&dev->buffer_lock);
-        AESD_CIRCULAR_BUFFER_FOREACH(entry, &dev->buffer, index) {
-            if (entry->buffptr != NULL)
-                newpos += entry->size;
-        }
-        mutex_unlock(&dev->buffer_lock);
-
+        rcu_read_lock();
+        do {
+            seq = aesd_snapshot(file->dev, &snapshot);
+        } while (read_seqcount_retry(&file->dev->seq, seq));
+        rcu_read_unlock();
+        newpos = aesd_circular_buffer_size(&snapshot) + off;
         break;
 
     default: /* can't happen */
@@ -275,44 +616,84 @@ loff_t aesd_llseek(struct file *filp, loff_t off, int whence) {
     return newpos;
 }
 
+/**
+ * Changes the number of write commands kept by @param dev to @param new_depth, keeping the
+ * newest ones. A depth of AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED goes back to the array
+ * embedded in the buffer.
+ * @return 0 on success, a negative errno otherwise.
+ */
+static long aesd_set_depth(struct aesd_dev *dev, uint32_t new_depth) {
+    struct aesd_buffer_entry *entries = NULL, *previous, removed;
+
+    if (new_depth == 0 || new_depth > AESDCHAR_MAX_DEPTH)
+        return -EINVAL;
+    // allocate before taking the lock, writers only wait for the copy
+    if (new_depth != AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) {
+        entries = kvcalloc(new_depth, sizeof(struct aesd_buffer_entry), GFP_KERNEL);
+        if (!entries)
+            return -ENOMEM;
+    }
+    if (mutex_lock_interruptible(&dev->buffer_lock)) {
+        kvfree(entries);
+        return -ERESTARTSYS;
+    }
+    write_seqcount_begin(&dev->seq);
+    // drop the oldest entries that don't fit
+    while (aesd_circular_buffer_count(&dev->buffer) > new_depth &&
+           aesd_circular_buffer_remove_oldest(&dev->buffer, &removed))
+        aesd_record_put(removed.buffptr);
+    previous = aesd_circular_buffer_resize(&dev->buffer, entries, new_depth);
+    write_seqcount_end(&dev->seq);
+    if (dev->map)
+        aesd_map_history(dev);
+    mutex_unlock(&dev->buffer_lock);
+
+    if (previous != dev->buffer.default_entry) {
+        synchronize_rcu(); // lock-free readers may still be looking at the previous array
+        kvfree(previous);
+    }
+    PDEBUG("history depth set to %u", new_depth);
+    return 0;
+}
+
 long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long value) {
-    struct aesd_dev *dev = filp->private_data;
+    struct aesd_file *file = filp->private_data;
     if (cmd == AESDCHAR_IOCSEEKTO) {
         struct aesd_seekto seekto;
-        copy_from_user(&seekto, (void *)value, sizeof(struct aesd_seekto));
+        if (copy_from_user(&seekto, (void __user *)value, sizeof(struct aesd_seekto)))
+            return -EFAULT;
         PDEBUG("ioctl: seeking to write_cmd: %u write_cmd_offset: %u", seekto.write_cmd,
                seekto.write_cmd_offset);
 
-        if (seekto.write_cmd > AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
-            return -1;
-        mutex_lock_interruptible(&dev->buffer_lock);
-
-        PDEBUG("ioctl seeking: out_off %u in_off: %u", dev->buffer.out_offs, dev->buffer.in_offs);
-        size_t i = dev->buffer.out_offs;
-        struct aesd_buffer_entry *entry;
-        struct aesd_circular_buffer *circ_buff = &dev->buffer;
-        ssize_t cursor = 0;
-        int ret = 0;
+        // write_cmd counts from the oldest command kept, its start offset is stored with it
+        struct aesd_circular_buffer snapshot;
+        struct aesd_buffer_entry *entry, found = {0};
+        unsigned int seq;
+        rcu_read_lock();
         do {
-            PDEBUG("looking for entry, currently at: %lu, while target is %u\n", i, seekto.write_cmd);
-            entry = &circ_buff->entry[i];
-            if (i == seekto.write_cmd) {
-                if (entry->size <= seekto.write_cmd_offset || entry->buffptr == NULL) {
-                    ret = -1;
-                } else {
-                    PDEBUG("found entry, updating fpos to: %ld\n", cursor);
-                    cursor += seekto.write_cmd_offset;
-                    filp->f_pos = cursor;
-                }
-                break;
-            } else if (entry->buffptr != NULL) {
-                cursor += entry->size;
-            }
-            i = (i + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-        } while ((i != dev->buffer.in_offs));
-
-        mutex_unlock(&dev->buffer_lock);
-        return ret;
+            seq = aesd_snapshot(file->dev, &snapshot);
+            if (read_seqcount_retry(&file->dev->seq, seq))
+                continue;
+            entry = aesd_circular_buffer_get_entry(&snapshot, seekto.write_cmd);
+            if (entry)
+                found = *entry;
+        } while (read_seqcount_retry(&file->dev->seq, seq));
+        rcu_read_unlock();
+        if (!entry || seekto.write_cmd_offset >= found.size)
+            return -EINVAL;
+        filp->f_pos = aesd_circular_buffer_entry_fpos(&snapshot, &found) + seekto.write_cmd_offset;
+        PDEBUG("found entry, updating fpos to: %lld\n", filp->f_pos);
+        return 0;
+    } else if (cmd == AESDCHAR_IOCSETDEPTH) {
+        uint32_t new_depth;
+        if (copy_from_user(&new_depth, (void __user *)value, sizeof(new_depth)))
+            return -EFAULT;
+        return aesd_set_depth(file->dev, new_depth);
+    } else if (cmd == AESDCHAR_IOCGETDEPTH) {
+        uint32_t current_depth = READ_ONCE(file->dev->buffer.depth);
+        if (copy_to_user((void __user *)value, &current_depth, sizeof(current_depth)))
+            return -EFAULT;
+        return 0;
     } else {
         return -1;
     }
@@ -326,6 +707,7 @@ struct file_operations aesd_fops = {
     .release = aesd_close,
     .llseek = aesd_llseek,
     .unlocked_ioctl = aesd_ioctl,
+    .mmap = aesd_mmap,
 };
 
 static int aesd_setup_cdev(struct aesd_dev *dev, dev_t devno) {
@@ -345,18 +727,34 @@ int aesd_init_module(void) {
     int result;
     dev_t dev = 0;
     const unsigned int minor_nbrs = 1;
+    aesd_chunk_cache = kmem_cache_create("aesdchar_chunk", AESD_CHUNK_SIZE, 0, 0, NULL);
+    if (!aesd_chunk_cache)
+        return -ENOMEM;
     aesd_dev_init(&aesd_device);
+    if (depth != AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) {
+        result = aesd_set_depth(&aesd_device, depth);
+        if (result) {
+            printk(KERN_WARNING "aesdchar: invalid history depth %u\n", depth);
+            aesd_dev_cleanup(&aesd_device);
+            kmem_cache_destroy(aesd_chunk_cache);
+            return result;
+        }
+    }
     // register a range of char device numbers using `alloc_...` instead of `register_...` because
     // we need a dynamic major number
     result = alloc_chrdev_region(&dev, aesd_device.minor, minor_nbrs, "aesdchar");
     if (result < 0) {
         printk(KERN_WARNING "Can't get major %d\n", aesd_device.major);
+        aesd_dev_cleanup(&aesd_device);
+        kmem_cache_destroy(aesd_chunk_cache);
         return result;
     }
     aesd_device.major = MAJOR(dev);
     result = aesd_setup_cdev(&aesd_device, dev);
     if (result) {
         unregister_chrdev_region(dev, minor_nbrs);
+        aesd_dev_cleanup(&aesd_device);
+        kmem_cache_destroy(aesd_chunk_cache);
     }
     return result;
 }
@@ -365,7 +763,8 @@ void aesd_cleanup_module(void) {
     dev_t devno = MKDEV(aesd_device.major, aesd_device.minor);
 
     cdev_del(&aesd_device.cdev);
-    aesd_dev_cleanup(&aesd_device);
+    aesd_dev_cleanup(&aesd_device); // waits for the chunks freed after a grace period
+    kmem_cache_destroy(aesd_chunk_cache);
     unregister_chrdev_region(devno, 1);
 }
 
@@ -0,0 +1,52 @@
+/*
+ * aesd_binary.h
+ *
+ * Wire format of the binary protocol served by aesdsocket on the port given with -B.
+ *
+ * Requests and responses are frames: a struct aesd_frame header followed by len bytes of
+ * payload. Every integer, in the header and in the payloads, is in network byte order. Each
+ * request frame gets exactly one response frame with the same opcode, in request order, so a
+ * client may pipeline as many requests as it likes. A response with a non-zero status has no
+ * payload.
+ */
+
+#ifndef AESD_BINARY_H
+#define AESD_BINARY_H
+
+#include <stdint.h>
+
+struct aesd_frame {
+    uint32_t len;      // payload bytes following the header
+    uint8_t opcode;    // enum aesd_opcode, echoed in the response
+    uint8_t status;    // responses: 0 on success, an errno value otherwise
+    uint16_t reserved; // 0
+};
+
+enum aesd_opcode {
+    /**
+     * Appends a batch of records to the history, each record is written as is. The char device
+     * closes an entry at each new line, not at the end of a record: a record that doesn't end
+     * with one is joined with what is written next into the same entry.
+     * Request: records, each a uint32_t length followed by that many bytes.
+     * Response: uint64_t history offset of the first record (UINT64_MAX with the char device),
+     * uint32_t number of records appended.
+     */
+    AESD_OP_APPEND = 1,
+    /**
+     * Reads a range of the history.
+     * Request: uint64_t offset, uint32_t maximum length.
+     * Response: the bytes of the history from offset, at most the maximum length (less at the
+     * end of the history).
+     */
+    AESD_OP_READ = 2,
+    /**
+     * Seeks like AESDCHAR_IOCSEEKTO then reads from there.
+     * Request: uint32_t write_cmd, uint32_t write_cmd_offset, uint32_t maximum length.
+     * Response: the bytes of the history from the seek position, at most the maximum length.
+     */
+    AESD_OP_SEEK_READ = 3,
+};
+
+#define AESD_FRAME_MAX (64u << 20) // largest request payload accepted (unless -L is lower)
+
+#endif /* AESD_BINARY_H */
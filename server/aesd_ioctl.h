@@ -38,9 +38,48 @@ struct aesd_seekto {
 
 // Define a write command from the user point of view, use command number 1
 #define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+// Change the number of write commands the device keeps, the newest ones are kept
+#define AESDCHAR_IOCSETDEPTH _IOW(AESD_IOC_MAGIC, 2, uint32_t)
+// Read the number of write commands the device keeps
+#define AESDCHAR_IOCGETDEPTH _IOR(AESD_IOC_MAGIC, 3, uint32_t)
+
+/**
+ * Layout of the read-only mapping of the device (mmap): a header of AESD_MMAP_HEADER_SIZE bytes
+ * followed by a data ring of data_size bytes. Byte X of everything ever written to the device
+ * (its stream offset, see aesd_buffer_entry.offset) is at data offset X % data_size, as long as
+ * X >= first_offset.
+ *
+ * A consumer reads the header fields between two reads of an equal and even generation, uses
+ * the data in [first_offset, end_offset) and then reads first_offset again: the data it used is
+ * intact if it is still at or after first_offset.
+ */
+#define AESD_MMAP_HEADER_SIZE 4096
+#define AESD_MMAP_MAGIC 0x61657364 // "aesd"
+
+struct aesd_mmap_entry {
+    uint64_t offset; // stream offset of the first byte of the write command
+    uint64_t size;
+};
+
+struct aesd_mmap_header {
+    uint32_t magic;        // AESD_MMAP_MAGIC
+    uint32_t entry_slots;  // number of entries[] slots
+    uint64_t generation;   // odd while the driver updates the mapping
+    uint64_t data_size;    // bytes of the data ring
+    uint64_t history_offset; // stream offset of file position 0: the oldest write command kept
+    uint64_t first_offset; // oldest byte of the history still in the data ring, at a command start
+    uint64_t end_offset;   // stream offset right after the newest write command
+    uint64_t entries_written; // write commands ever added to the device
+    /**
+     * Write command number N (counted from 0 since the device was loaded) is described by
+     * entries[N % entry_slots], for the newest entry_slots commands
+     */
+    struct aesd_mmap_entry entries[];
+};
+
 /**
  * The maximum number of commands supported, used for bounds checking
  */
-#define AESDCHAR_IOC_MAXNR 1
+#define AESDCHAR_IOC_MAXNR 3
 
 #endif /* AESD_IOCTL_H */
@@ -0,0 +1,512 @@
+/**
+ * @file aesdload.c
+ * @brief Load generator and latency benchmark for aesdsocket
+ *
+ * Opens a number of concurrent client connections against the server (loopback by default),
+ * sends packets of a given size at a given rate, optionally split into partial sends or
+ * replaced by AESDCHAR_IOCSEEKTO commands, and reports the request throughput, the bytes
+ * replayed by the server and a latency histogram. Only the protocol is used, so the same run
+ * works against the data file and the char device backends.
+ *
+ * Without -s every request uses its own connection (connect, send, read the replay until the
+ * server closes it). With -s the connections stay open and replies are read using their
+ * "LEN:<n>\n" header, which needs a server started with -s too.
+ *
+ * With -b the binary protocol (aesd_binary.h, server started with -B) is used instead: every
+ * request is an APPEND frame carrying a batch of packets as records, on persistent connections.
+ */
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "aesd_binary.h"
+
+// log-linear latency histogram: 2^SUB_BITS buckets per power of two (~3% resolution)
+#define SUB_BITS 5
+#define SUB_COUNT (1 << SUB_BITS)
+#define HIST_BUCKETS ((64 - SUB_BITS + 1) * SUB_COUNT)
+
+struct histogram {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+};
+
+struct load_config {
+    const char *host;
+    int port;
+    int connections;  // concurrent connections (one thread each)
+    int requests;     // requests per connection, when no duration is given
+    double duration;  // seconds, 0: run the requests count
+    size_t size;      // bytes per packet, new line included
+    double rate;      // packets per second and connection, 0: as fast as possible
+    int fragments;    // number of send() calls each packet is split into
+    int seek_every;   // every n-th request is an AESDCHAR_IOCSEEKTO:0,0 command, 0: never
+    int session;      // persistent connections with LEN framed replies
+    int batch;        // binary protocol: records per APPEND frame, 0: text protocol
+};
+
+static struct load_config config = {
+    .host = "127.0.0.1",
+    .port = 9000,
+    .connections = 4,
+    .requests = 100,
+    .duration = 0,
+    .size = 64,
+    .rate = 0,
+    .fragments = 1,
+    .seek_every = 0,
+    .session = 0,
+    .batch = 0,
+};
+
+struct client {
+    pthread_t thread;
+    int id;
+    struct histogram hist;
+    uint64_t requests;
+    uint64_t records; // binary protocol: packets appended
+    uint64_t errors;
+    uint64_t bytes_sent;
+    uint64_t bytes_replayed;
+};
+
+static struct sockaddr_in server_addr;
+static uint64_t start_ns, stop_ns; // stop_ns: 0 when the run is bounded by request count
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t deadline) {
+    struct timespec ts = {
+        .tv_sec = deadline / 1000000000ull,
+        .tv_nsec = deadline % 1000000000ull,
+    };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+static int hist_index(uint64_t value) {
+    if (value < SUB_COUNT)
+        return value;
+    int exp = 63 - __builtin_clzll(value); // >= SUB_BITS
+    return (exp - SUB_BITS + 1) * SUB_COUNT + ((value >> (exp - SUB_BITS)) & (SUB_COUNT - 1));
+}
+
+/**
+ * @return the lowest value counted in the bucket @param index.
+ */
+static uint64_t hist_value(int index) {
+    if (index < SUB_COUNT)
+        return index;
+    int exp = index / SUB_COUNT + SUB_BITS - 1;
+    return (uint64_t)(SUB_COUNT + index % SUB_COUNT) << (exp - SUB_BITS);
+}
+
+static void hist_record(struct histogram *hist, uint64_t value) {
+    hist->counts[hist_index(value)]++;
+    hist->total++;
+    if (value > hist->max)
+        hist->max = value;
+}
+
+static void hist_merge(struct histogram *dst, const struct histogram *src) {
+    for (int i = 0; i < HIST_BUCKETS; i++)
+        dst->counts[i] += src->counts[i];
+    dst->total += src->total;
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+/**
+ * @return the value below which a fraction @param q of the recorded values lie.
+ */
+static uint64_t hist_quantile(const struct histogram *hist, double q) {
+    uint64_t rank = (uint64_t)(q * hist->total), seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist->counts[i];
+        if (seen > rank)
+            return hist_value(i) < hist->max ? hist_value(i) : hist->max;
+    }
+    return hist->max;
+}
+
+static int send_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t bytes = send(fd, buf, len, MSG_NOSIGNAL);
+        if (bytes < 0 && errno == EINTR)
+            continue;
+        if (bytes <= 0)
+            return -1;
+        buf += bytes;
+        len -= bytes;
+    }
+    return 0;
+}
+
+/**
+ * Sends the @param len bytes of @param packet in config.fragments parts, pausing briefly
+ * between them so that the server receives partial packets.
+ */
+static int send_packet(int fd, const char *packet, size_t len) {
+    int parts = config.fragments < (int)len ? config.fragments : (int)len;
+    size_t done = 0;
+    for (int i = 1; i <= parts; i++) {
+        size_t end = len * i / parts;
+        if (send_all(fd, packet + done, end - done))
+            return -1;
+        done = end;
+        if (i < parts)
+            usleep(100);
+    }
+    return 0;
+}
+
+static int connect_server(void) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, (struct sockaddr *)&server_addr, sizeof(server_addr))) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Reads a reply until the server closes the connection.
+ * @return the number of bytes received, -1 on failure.
+ */
+static ssize_t read_until_eof(int fd, char *buf, size_t size) {
+    ssize_t total = 0, bytes;
+    while ((bytes = recv(fd, buf, size, 0)) != 0) {
+        if (bytes < 0 && errno == EINTR)
+            continue;
+        if (bytes < 0)
+            return -1;
+        total += bytes;
+    }
+    return total;
+}
+
+/**
+ * Reads a "LEN:<n>\n" framed reply.
+ * @return the number of history bytes received, -1 on failure.
+ */
+static ssize_t read_framed(int fd, char *buf, size_t size) {
+    char header[32];
+    size_t header_len = 0;
+    // the header is read byte by byte, so nothing of the history is consumed with it
+    while (header_len < sizeof(header) - 1) {
+        ssize_t bytes = recv(fd, header + header_len, 1, 0);
+        if (bytes < 0 && errno == EINTR)
+            continue;
+        if (bytes <= 0)
+            return -1;
+        if (header[header_len++] == '\n')
+            break;
+    }
+    header[header_len] = '\0';
+    unsigned long long left;
+    if (sscanf(header, "LEN:%llu", &left) != 1)
+        return -1;
+
+    ssize_t total = 0;
+    while (left > 0) {
+        ssize_t bytes = recv(fd, buf, left < size ? left : size, 0);
+        if (bytes < 0 && errno == EINTR)
+            continue;
+        if (bytes <= 0)
+            return -1;
+        total += bytes;
+        left -= bytes;
+    }
+    return total;
+}
+
+/**
+ * Reads a binary protocol response frame.
+ * @return the number of payload bytes received, -1 on failure or on an error status.
+ */
+static ssize_t read_frame(int fd, char *buf, size_t size) {
+    struct aesd_frame frame;
+    size_t got = 0;
+    while (got < sizeof(frame)) {
+        ssize_t bytes = recv(fd, (char *)&frame + got, sizeof(frame) - got, 0);
+        if (bytes < 0 && errno == EINTR)
+            continue;
+        if (bytes <= 0)
+            return -1;
+        got += bytes;
+    }
+
+    size_t left = ntohl(frame.len);
+    ssize_t total = 0;
+    while (left > 0) {
+        ssize_t bytes = recv(fd, buf, left < size ? left : size, 0);
+        if (bytes < 0 && errno == EINTR)
+            continue;
+        if (bytes <= 0)
+            return -1;
+        total += bytes;
+        left -= bytes;
+    }
+    return frame.status ? -1 : total;
+}
+
+/**
+ * Builds the binary request frame of @param opcode with the @param len bytes of @param payload
+ * in @param frame.
+ * @return the length of the frame.
+ */
+static size_t build_frame(char *frame, uint8_t opcode, const void *payload, size_t len) {
+    struct aesd_frame header = {.len = htonl(len), .opcode = opcode};
+    memcpy(frame, &header, sizeof(header));
+    memcpy(frame + sizeof(header), payload, len);
+    return sizeof(header) + len;
+}
+
+static void *client_main(void *arg) {
+    struct client *client = arg;
+    size_t bufsize = 1 << 20;
+    char *buf = malloc(bufsize);
+    // binary protocol: the packet is a whole APPEND frame of config.batch records
+    size_t packet_size = config.batch
+                             ? sizeof(struct aesd_frame) + config.batch * (4 + config.size)
+                             : config.size;
+    char *packet = malloc(packet_size);
+    if (!buf || !packet) {
+        fprintf(stderr, "client %d: out of memory\n", client->id);
+        client->errors++;
+        free(buf);
+        free(packet);
+        return NULL;
+    }
+    for (size_t i = 0; i + 1 < config.size; i++)
+        packet[i] = 'a' + (client->id + i) % 26;
+    packet[config.size - 1] = '\n';
+    char seek[32] = "AESDCHAR_IOCSEEKTO:0,0\n";
+    size_t seek_len = strlen(seek);
+    if (config.batch) {
+        char *records = malloc(config.batch * (4 + config.size));
+        if (!records) {
+            fprintf(stderr, "client %d: out of memory\n", client->id);
+            client->errors++;
+            free(buf);
+            free(packet);
+            return NULL;
+        }
+        uint32_t record_len = htonl(config.size);
+        for (int i = 0; i < config.batch; i++) {
+            memcpy(records + i * (4 + config.size), &record_len, 4);
+            memcpy(records + i * (4 + config.size) + 4, packet, config.size);
+        }
+        packet_size =
+            build_frame(packet, AESD_OP_APPEND, records, config.batch * (4 + config.size));
+        free(records);
+        uint32_t seek_args[3] = {0, 0, htonl(bufsize)}; // AESDCHAR_IOCSEEKTO:0,0
+        seek_len = build_frame(seek, AESD_OP_SEEK_READ, seek_args, sizeof(seek_args));
+    }
+
+    int fd = -1;
+    uint64_t interval = config.rate > 0 ? (uint64_t)(1e9 / config.rate) : 0;
+    uint64_t next = start_ns;
+    for (uint64_t n = 0;; n++) {
+        if (stop_ns ? now_ns() >= stop_ns : n >= (uint64_t)config.requests)
+            break;
+        // open loop pacing: latency is measured from the scheduled send time, so that a
+        // stalled server can't hide its queueing delay by slowing the client down
+        if (interval) {
+            sleep_until(next);
+        } else {
+            next = now_ns();
+        }
+        uint64_t scheduled = next;
+        next += interval;
+
+        const char *data = packet;
+        size_t len = packet_size;
+        if (config.seek_every && n % config.seek_every == config.seek_every - 1) {
+            data = seek;
+            len = seek_len;
+        }
+
+        if (fd < 0 && (fd = connect_server()) < 0) {
+            client->errors++;
+            continue;
+        }
+        ssize_t replayed = -1;
+        if (send_packet(fd, data, len) == 0)
+            replayed = config.batch     ? read_frame(fd, buf, bufsize)
+                       : config.session ? read_framed(fd, buf, bufsize)
+                                        : read_until_eof(fd, buf, bufsize);
+        if (replayed < 0 || !(config.session || config.batch)) {
+            close(fd);
+            fd = -1;
+        }
+        if (replayed < 0) {
+            client->errors++;
+            continue;
+        }
+        hist_record(&client->hist, now_ns() - scheduled);
+        client->requests++;
+        if (config.batch && data == packet)
+            client->records += config.batch;
+        client->bytes_sent += len;
+        client->bytes_replayed += replayed;
+    }
+    if (fd >= 0)
+        close(fd);
+    free(buf);
+    free(packet);
+    return NULL;
+}
+
+static void usage(const char *prog) {
+    printf("Usage: %s [-H host] [-p port] [-c connections] [-n requests | -t seconds]"
+           " [-l size] [-r rate] [-f fragments] [-k seek_every] [-s] [-b records]\n"
+           "  -H  server address (default: 127.0.0.1)\n"
+           "  -p  server port (default: 9000)\n"
+           "  -c  number of concurrent connections (default: 4)\n"
+           "  -n  requests per connection (default: 100)\n"
+           "  -t  run for this many seconds instead of a number of requests\n"
+           "  -l  packet size in bytes, new line included (default: 64)\n"
+           "  -r  packets per second and connection, 0: as fast as possible (default: 0)\n"
+           "  -f  split every packet into this many partial sends (default: 1)\n"
+           "  -k  make every k-th request an AESDCHAR_IOCSEEKTO:0,0 command (default: never)\n"
+           "  -s  session mode: keep connections open, replies are LEN:<n> framed (the\n"
+           "      server must run with -s too)\n"
+           "  -b  binary protocol (server started with -B, use -p to reach its port): every\n"
+           "      request is an APPEND frame of this many packets (-k: SEEK_READ requests)\n",
+           prog);
+}
+
+static int parse_options(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "H:p:c:n:t:l:r:f:k:sb:")) != -1) {
+        switch (opt) {
+        case 'H':
+            config.host = optarg;
+            break;
+        case 'p':
+            config.port = atoi(optarg);
+            break;
+        case 'c':
+            config.connections = atoi(optarg);
+            break;
+        case 'n':
+            config.requests = atoi(optarg);
+            break;
+        case 't':
+            config.duration = atof(optarg);
+            break;
+        case 'l':
+            config.size = strtoul(optarg, NULL, 0);
+            break;
+        case 'r':
+            config.rate = atof(optarg);
+            break;
+        case 'f':
+            config.fragments = atoi(optarg);
+            break;
+        case 'k':
+            config.seek_every = atoi(optarg);
+            break;
+        case 's':
+            config.session = 1;
+            break;
+        case 'b':
+            config.batch = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    if (config.connections <= 0 || config.size == 0 || config.fragments <= 0) {
+        usage(argv[0]);
+        return -1;
+    }
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(config.port);
+    if (inet_pton(AF_INET, config.host, &server_addr.sin_addr) != 1) {
+        fprintf(stderr, "Invalid server address %s\n", config.host);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (parse_options(argc, argv))
+        return 1;
+
+    struct client *clients = calloc(config.connections, sizeof(struct client));
+    if (!clients) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    start_ns = now_ns();
+    stop_ns = config.duration > 0 ? start_ns + (uint64_t)(config.duration * 1e9) : 0;
+    int started = 0;
+    for (; started < config.connections; started++) {
+        clients[started].id = started;
+        int err = pthread_create(&clients[started].thread, NULL, client_main, &clients[started]);
+        if (err) {
+            fprintf(stderr, "Failed to start client %d: %s\n", started, strerror(err));
+            break;
+        }
+    }
+
+    struct histogram *total = calloc(1, sizeof(struct histogram));
+    if (!total) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    uint64_t requests = 0, records = 0, errors = 0, sent = 0, replayed = 0;
+    for (int i = 0; i < started; i++) {
+        pthread_join(clients[i].thread, NULL);
+        hist_merge(total, &clients[i].hist);
+        requests += clients[i].requests;
+        records += clients[i].records;
+        errors += clients[i].errors;
+        sent += clients[i].bytes_sent;
+        replayed += clients[i].bytes_replayed;
+    }
+    double elapsed = (now_ns() - start_ns) / 1e9;
+
+    printf("connections %d, packet size %zu, elapsed %.3f s\n", started, config.size, elapsed);
+    printf("requests    %llu (%llu errors), %.1f req/s\n", (unsigned long long)requests,
+           (unsigned long long)errors, requests / elapsed);
+    if (config.batch)
+        printf("records     %llu, %.1f records/s\n", (unsigned long long)records,
+               records / elapsed);
+    printf("sent        %llu bytes, %.2f MiB/s\n", (unsigned long long)sent,
+           sent / elapsed / (1 << 20));
+    printf("replayed    %llu bytes, %.2f MiB/s\n", (unsigned long long)replayed,
+           replayed / elapsed / (1 << 20));
+    printf("latency us  p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+           hist_quantile(total, 0.5) / 1e3, hist_quantile(total, 0.9) / 1e3,
+           hist_quantile(total, 0.99) / 1e3, hist_quantile(total, 0.999) / 1e3,
+           total->max / 1e3);
+
+    free(total);
+    free(clients);
+    return errors ? 2 : 0;
+}
@@ -1,8 +1,8 @@
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <sys/queue.h>
+#include <sys/sendfile.h>
 #include <netdb.h>
-#include <syslog.h>
 #include <errno.h>
 #include <string.h>
 #include <stdio.h>
@@ -14,135 +14,377 @@
 #include <fcntl.h>
 #include <time.h>
 #include "aesd_ioctl.h"
+#include "aesdsocket.h"
+#include "framing.h"
+#include "history.h"
+#include "metrics.h"
+#include "timestamp.h"
+#include "log.h"
 
-#define USE_AESD_CHAR_DEVICE 1
+volatile sig_atomic_t run = 1;
 
+#define SENDFILE_CHUNK (1 << 20) // bytes sent per sendfile() call while holding the lock
+#define SPLICE_CHUNK (1 << 16)   // default pipe capacity
+
+struct server_config config = {
+    .daemon = 0,
+    .session = 0,
+    .engine = ENGINE_EPOLL,
+    .workers = 0, // defaults to the number of online CPUs
+    .max_inflight = 0, // defaults to 8 connections per worker (io_uring: 1024)
+    .overload = OVERLOAD_WAIT,
+    .sync_writes = 0,
+    .group_commit = 0,
+    .cache_size = 16 << 20,
+    .shards = 1,
 #if USE_AESD_CHAR_DEVICE == 1
-    #define OUT_FILE "/dev/aesdchar"
-    #define OUT_RW "r+"
+    .timestamp_interval = 0, // the device only holds what clients wrote, unless -t is given
 #else
-    #define OUT_FILE "/var/tmp/aesdsocketdata"
-    #define OUT_RW "ab"
+    .timestamp_interval = 10000000000LL,
 #endif
+    .timestamp_clock = CLOCK_REALTIME,
+    .read_timeout = 300000,
+    .write_timeout = 30000,
+    .max_packet = 0,
+    .segment_size = 0, // a single data file, HISTORY_SEGMENT_SIZE once segmented
+};
 
+void handle_signal(int signal) {
+    log_msg(LOG_DEBUG, "Caught signal. exiting");
+    run = 0;
+}
 
+#define CONN_SLAB_SIZE 64 // connection objects allocated at once when none is free
 
-
-int run = 1;
-int sockfd = -1;
-static pthread_mutex_t out_file_sync;
-
-typedef struct {
-    int fd;
-    char *client_ip;
-} connection_info;
-
-struct thread_entry {
-    pthread_t thread_id;
-    TAILQ_ENTRY(thread_entry) entries;
+/**
+ * A block of connection objects. Closed connections go back to a free list and blocks are only
+ * released at exit, so accepting and closing connections never goes through malloc()/free().
+ */
+struct conn_slab {
+    struct conn_slab *next;
+    connection_info conns[CONN_SLAB_SIZE];
 };
-typedef TAILQ_HEAD(thread_queue, thread_entry) threads_queue_head_t;
 
-void *run_client_request(void *info);
+static struct {
+    pthread_mutex_t lock;
+    struct conn_slab *slabs;
+    connection_info *free; // linked through next_free
+} conn_cache = {.lock = PTHREAD_MUTEX_INITIALIZER};
 
-void handle_signal(int signal) {
-    syslog(LOG_DEBUG, "Caught signal. exiting");
-    run = 0;
+static connection_info *conn_alloc(void) {
+    pthread_mutex_lock(&conn_cache.lock);
+    if (!conn_cache.free) {
+        struct conn_slab *slab = malloc(sizeof(struct conn_slab));
+        if (!slab) {
+            pthread_mutex_unlock(&conn_cache.lock);
+            return NULL;
+        }
+        slab->next = conn_cache.slabs;
+        conn_cache.slabs = slab;
+        for (int i = 0; i < CONN_SLAB_SIZE; i++) {
+            slab->conns[i].next_free = conn_cache.free;
+            conn_cache.free = &slab->conns[i];
+        }
+    }
+    connection_info *info = conn_cache.free;
+    conn_cache.free = info->next_free;
+    pthread_mutex_unlock(&conn_cache.lock);
+    return info;
 }
 
-void timer_handler(union sigval arg) {
-    FILE *file;
-    char buffer[80]; // Buffer to hold the formatted time
-    time_t now = time(NULL);
-    struct tm *tm_info = localtime(&now);
-    // Format the current time according to RFC 2822 format
-    strftime(buffer, sizeof(buffer), "%a, %d %b %Y %H:%M:%S %z", tm_info);
-
-    // Open the file in append mode
-    file = fopen(OUT_FILE, "a");
-
-    // Write the timestamp to the file
-    pthread_mutex_lock(&out_file_sync);
-    fprintf(file, "timestamp: %s\n", buffer);
-    fclose(file); // Close the file
-    pthread_mutex_unlock(&out_file_sync);
+static void conn_free(connection_info *info) {
+    pthread_mutex_lock(&conn_cache.lock);
+    info->next_free = conn_cache.free;
+    conn_cache.free = info;
+    pthread_mutex_unlock(&conn_cache.lock);
 }
 
-timer_t timer_id;
-void setup_timer() {
-    struct sigevent sev;
-    struct itimerspec its;
-
-    // Configure the timer to call 'timer_handler' when it expires
-    sev.sigev_notify = SIGEV_THREAD;       // Notify using a separate thread
-    sev.sigev_value.sival_ptr = &timer_id; // Pass the timer_id to the handler
-    sev.sigev_notify_function = timer_handler;
-    sev.sigev_notify_attributes = NULL;
-
-    // Create the timer
-    if (timer_create(CLOCK_REALTIME, &sev, &timer_id) == -1) {
-        perror("timer_create failed");
-        exit(EXIT_FAILURE);
+/**
+ * Releases the connection objects, once every connection has been closed.
+ */
+void connection_cache_cleanup(void) {
+    while (conn_cache.slabs) {
+        struct conn_slab *slab = conn_cache.slabs;
+        conn_cache.slabs = slab->next;
+        free(slab);
     }
+    conn_cache.free = NULL;
+}
 
-    // Configure the timer to trigger every 10 seconds
-    its.it_value.tv_sec = 10; // Initial expiration in seconds
-    its.it_value.tv_nsec = 0;
-    its.it_interval.tv_sec = 10; // Interval for periodic timer
-    its.it_interval.tv_nsec = 0;
+/**
+ * Sets up the state of a connection accepted as @param fd from @param client, speaking the
+ * binary protocol if @param binary is set.
+ * @return the connection, NULL if out of memory (@param fd is left open).
+ */
+connection_info *new_connection(int fd, const struct sockaddr_in *client, int binary) {
+    connection_info *info = conn_alloc();
+    if (!info) {
+        log_msg(LOG_ERR, "Out of memory, dropping a new connection");
+        return NULL;
+    }
+    info->fd = fd;
+    info->binary = binary;
+    info->out_fd = -1;
+    info->state = CONN_RECV;
+    info->len = 0;
+    info->sent = 0;
+    frame_init(&info->rx, info->rx_buffer, sizeof(info->rx_buffer));
+    info->pipe_fds[0] = info->pipe_fds[1] = -1;
+    info->chunk = NULL;
+    info->since = -1;
+    info->seek_pos = -1;
+    info->replay_max = SIZE_MAX;
+    info->frame = NULL;
+    info->stats = 0;
+    info->pkt_bytes = 0;
+    info->last_active = metrics_now();
+    inet_ntop(AF_INET, &client->sin_addr, info->client_ip, INET_ADDRSTRLEN);
+    log_msg(LOG_INFO, "Accepted connection from %s", info->client_ip);
+    metrics_add(M_CONN_ACCEPTED, 1);
+    metrics_add(M_CONN_ACTIVE, 1);
+    return info;
+}
 
-    // Start the timer
-    if (timer_settime(timer_id, 0, &its, NULL) == -1) {
-        perror("timer_settime failed");
-        exit(EXIT_FAILURE);
+void close_connection(connection_info *info) {
+    if (info->chunk)
+        history_chunk_put(info->chunk);
+    free(info->frame);
+    history_close(info->out_fd);
+    if (info->pipe_fds[0] >= 0) {
+        close(info->pipe_fds[0]);
+        close(info->pipe_fds[1]);
     }
+    close(info->fd); // close connection, this also removes it from an epoll set
+    log_msg(LOG_INFO, "Closed connection from %s", info->client_ip);
+    metrics_add(M_CONN_ACTIVE, -1);
+    conn_free(info);
 }
 
-int main(int argc, char **argv) {
-    // ----------------------------------------------------------------------------
-    openlog("aesdsocket", 0, LOG_USER);
-    char server_ip[INET_ADDRSTRLEN];
-#if USE_AESD_CHAR_DEVICE != 1
-    remove(OUT_FILE);
+void usage(const char *prog) {
+    printf("Usage: %s [-d] [-s] [-m epoll|pool|uring] [-w workers] [-c max_inflight]"
+           " [-b wait|drop] [-y] [-g] [-M cache_MiB] [-S shards]"
+           " [-t seconds] [-k realtime|monotonic] [-i seconds] [-o seconds] [-L bytes]"
+           " [-B port] [-G bytes] [-R bytes] [-N packets] [-A seconds]\n"
+           "  -d  run as a daemon\n"
+           "  -s  session mode: keep connections open, every packet is answered with\n"
+           "      \"LEN:<n>\\n\" followed by the n bytes of history\n"
+           "  -m  connection engine (default: epoll)\n"
+           "  -w  number of worker threads of the pool engine (default: online CPUs)\n"
+           "  -c  maximum number of connections in flight in the pool and io_uring engines\n"
+           "      (default: 8 per worker, 1024 for io_uring)\n"
+           "  -b  what to do with new connections above the in-flight limit: wait until one\n"
+           "      finishes, or drop them (default: wait, io_uring always drops)\n"
+           "  -y  fdatasync every append before replying (io_uring: linked write+fsync)\n"
+           "  -g  group commit: concurrent appends are written (and synced with -y) in\n"
+           "      batches, one writev() per batch (epoll and pool engines)\n"
+           "  -M  memory cap of the in-memory history cache in MiB, 0 disables it\n"
+           "      (default: 16, data file backend only)\n"
+           "  -S  number of SO_REUSEPORT listeners, each served by its own engine on a\n"
+           "      thread pinned to a CPU, 0: one per CPU (default: 1)\n"
+           "  -t  interval between timestamp records, fractions allowed, 0 disables them\n"
+           "      (default: 10 with the data file, 0 with the char device)\n"
+           "  -k  clock of the timestamps: realtime (local time, RFC 2822) or monotonic\n"
+           "      (seconds since boot) (default: realtime)\n"
+           "  -i  read idle timeout: drop a connection waiting that long for (the rest of) a\n"
+           "      packet, 0 disables it (default: 300)\n"
+           "  -o  write timeout: drop a connection whose reply makes no progress for that\n"
+           "      long, 0 disables it (default: 30)\n"
+           "  -L  drop a connection whose packet grows over that many bytes before its new\n"
+           "      line, 0: no limit (default: 0)\n"
+           "  -B  also serve the binary protocol (aesd_binary.h) on this port, with its own\n"
+           "      epoll engine thread (default: disabled)\n"
+           "  -G  size of the segment files of the history, at least 4096 bytes: with it,\n"
+           "      or -R, -N or -A, OUT_FILE is a directory of segments instead of a single\n"
+           "      file (default: 64 MiB, data file backend only)\n"
+           "  -R  drop the oldest segments while the newer ones hold that many bytes,\n"
+           "      0: keep everything (default: 0, data file backend only)\n"
+           "  -N  drop the oldest segments while the newer ones hold that many packets,\n"
+           "      0: keep everything (default: 0, data file backend only)\n"
+           "  -A  drop full segments not written for that many seconds, fractions allowed,\n"
+           "      0: keep everything (default: 0, data file backend only)\n",
+           prog);
+}
+
+/**
+ * @return the timeout of @param arg seconds (fractions allowed) in milliseconds, 0 if disabled.
+ */
+static int parse_timeout(const char *arg) {
+    double seconds = strtod(arg, NULL);
+    return seconds > 0 ? (int)(seconds * 1000) : 0;
+}
+
+/**
+ * Fills the global config from the command line.
+ * @return 0 on success, -1 on invalid arguments.
+ */
+int parse_options(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "dsm:w:c:b:ygM:S:t:k:i:o:L:B:G:R:N:A:")) != -1) {
+        switch (opt) {
+        case 'd':
+            config.daemon = 1;
+            break;
+        case 's':
+            config.session = 1;
+            break;
+        case 'm':
+            if (!strcmp(optarg, "epoll")) {
+                config.engine = ENGINE_EPOLL;
+            } else if (!strcmp(optarg, "pool")) {
+                config.engine = ENGINE_POOL;
+            } else if (!strcmp(optarg, "uring")) {
+#ifdef HAVE_IO_URING
+                config.engine = ENGINE_URING;
+#else
+                printf("aesdsocket was built without io_uring support (make IO_URING=1)\n");
+                return -1;
 #endif
-    signal(SIGINT, handle_signal);
-    signal(SIGTERM, handle_signal);
-    // ----------------------------------------------------------------------------
-    int deamon = 0;
-    if (argc > 1 && !strcmp(argv[1], "-d")) {
-        deamon = 1;
-    };
+            } else {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'w':
+            config.workers = atoi(optarg);
+            break;
+        case 'c':
+            config.max_inflight = atoi(optarg);
+            break;
+        case 'b':
+            if (!strcmp(optarg, "wait")) {
+                config.overload = OVERLOAD_WAIT;
+            } else if (!strcmp(optarg, "drop")) {
+                config.overload = OVERLOAD_DROP;
+            } else {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'y':
+            config.sync_writes = 1;
+            break;
+        case 'g':
+            config.group_commit = 1;
+            break;
+        case 'M':
+            config.cache_size = (size_t)atoi(optarg) << 20;
+            break;
+        case 'S':
+            config.shards = atoi(optarg);
+            break;
+        case 't': {
+            double seconds = strtod(optarg, NULL);
+            config.timestamp_interval = seconds > 0 ? (int64_t)(seconds * 1e9) : 0;
+            break;
+        }
+        case 'k':
+            if (!strcmp(optarg, "realtime")) {
+                config.timestamp_clock = CLOCK_REALTIME;
+            } else if (!strcmp(optarg, "monotonic")) {
+                config.timestamp_clock = CLOCK_MONOTONIC;
+            } else {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'i':
+            config.read_timeout = parse_timeout(optarg);
+            break;
+        case 'o':
+            config.write_timeout = parse_timeout(optarg);
+            break;
+        case 'L':
+            config.max_packet = strtoull(optarg, NULL, 10);
+            break;
+        case 'B':
+            config.binary_port = atoi(optarg);
+            break;
+        case 'G':
+            config.segment_size = strtoll(optarg, NULL, 10);
+            if (config.segment_size < HISTORY_SEGMENT_MIN) {
+                printf("The segment size must be at least %d bytes\n", HISTORY_SEGMENT_MIN);
+                return -1;
+            }
+            break;
+        case 'R':
+            config.retain_bytes = strtoull(optarg, NULL, 10);
+            break;
+        case 'N':
+            config.retain_packets = strtoull(optarg, NULL, 10);
+            break;
+        case 'A': {
+            double seconds = strtod(optarg, NULL);
+            config.retain_age = seconds > 0 ? (int64_t)(seconds * 1e9) : 0;
+            break;
+        }
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
 
-    // ----------------------------------------------------------------------------
-    // open tcp socket on port 9000, return -1 on failture
+    if (config.workers <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        config.workers = cpus > 0 ? cpus : 1;
+    }
+    if (config.shards <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        config.shards = cpus > 0 ? cpus : 1;
+    }
+    if (config.max_inflight <= 0)
+        config.max_inflight = config.engine == ENGINE_URING ? 1024 : 8 * config.workers;
+    // segments are only needed to size or rotate them, the history is a single file otherwise
+    config.segmented = config.segment_size || config.retain_bytes || config.retain_packets ||
+                       config.retain_age;
+    if (!config.segment_size)
+        config.segment_size = config.segmented ? HISTORY_SEGMENT_SIZE : HISTORY_FILE_SIZE;
+    return 0;
+}
+
+/**
+ * Opens a non-blocking tcp socket listening on @param port, with SO_REUSEPORT if
+ * @param reuseport is set so that several of them can share the port.
+ * @return the socket, -1 on failure.
+ */
+static int open_listener(int port, int reuseport) {
+    char server_ip[INET_ADDRSTRLEN], service[8];
     struct addrinfo hints, *res;
     memset(&hints, 0, sizeof hints);
     hints.ai_family = AF_INET; // use IPv4
     hints.ai_socktype = SOCK_STREAM;
     hints.ai_flags = AI_PASSIVE;
-    getaddrinfo("0.0.0.0", "9000", &hints, &res);
-    sockfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    snprintf(service, sizeof(service), "%d", port);
+    getaddrinfo("0.0.0.0", service, &hints, &res);
+    int sockfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
     if (sockfd == -1) {
         freeaddrinfo(res);
         printf("Failed create socket: %s\n", strerror(errno));
         return -1;
     }
-    inet_ntop(AF_INET, &(res->ai_addr), server_ip, INET_ADDRSTRLEN);
+    inet_ntop(AF_INET, &((struct sockaddr_in *)res->ai_addr)->sin_addr, server_ip,
+              INET_ADDRSTRLEN);
 
     // Set SO_REUSEADDR option
     int opt = 1;
     if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-        syslog(LOG_ERR, "Failed to set SO_REUSEADDR: %s", strerror(errno));
+        log_msg(LOG_ERR, "Failed to set SO_REUSEADDR: %s", strerror(errno));
+        freeaddrinfo(res);
+        close(sockfd);
+        return -1;
+    }
+    // the kernel load balances new connections between the sockets sharing the port
+    if (reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        log_msg(LOG_ERR, "Failed to set SO_REUSEPORT: %s", strerror(errno));
         freeaddrinfo(res);
         close(sockfd);
         return -1;
     }
 
-    // bind socket to port 9000
+    // bind socket to the port
     if (bind(sockfd, res->ai_addr, res->ai_addrlen)) {
-        syslog(LOG_ERR, "Failed to bind socket to port 9000: %s",
-               strerror(errno));
-        printf("Failed to bind socket to port 9000: %s\n", strerror(errno));
+        log_msg(LOG_ERR, "Failed to bind socket to port %d: %s", port,
+                strerror(errno));
+        printf("Failed to bind socket to port %d: %s\n", port, strerror(errno));
         freeaddrinfo(res);
         close(sockfd);
         return -1;
@@ -153,145 +395,653 @@ int main(int argc, char **argv) {
     fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
 
     freeaddrinfo(res);
+
+    // Listen for connections
+    if (listen(sockfd, SOMAXCONN)) {
+        log_msg(LOG_ERR, "Failed to listen on %s:%d : %s", server_ip, port, strerror(errno));
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+/**
+ * Closes the @param count first sockets of @param listen_fds and releases the array.
+ */
+static void close_listeners(int *listen_fds, int count) {
+    for (int i = 0; i < count; i++)
+        close(listen_fds[i]);
+    free(listen_fds);
+}
+
+/**
+ * Serves the clients of @param listen_fd with the configured engine until `run` is cleared.
+ */
+int run_engine(int listen_fd, const sigset_t *wait_mask) {
+    switch (config.engine) {
+    case ENGINE_POOL:
+        return run_pool(listen_fd, wait_mask);
+#ifdef HAVE_IO_URING
+    case ENGINE_URING:
+        return run_uring(listen_fd, wait_mask);
+#endif
+    default:
+        return run_reactor(listen_fd, wait_mask);
+    }
+}
+
+int main(int argc, char **argv) {
+    // ----------------------------------------------------------------------------
+    openlog("aesdsocket", 0, LOG_USER);
+    // SIGINT/SIGTERM are only delivered while an engine sleeps (epoll_pwait/ppoll), so that a
+    // signal can never be lost between checking `run` and going to sleep.
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    // sendfile()/splice() have no MSG_NOSIGNAL, a client leaving early must not kill us
+    signal(SIGPIPE, SIG_IGN);
+    sigset_t blocked, wait_mask;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGINT);
+    sigaddset(&blocked, SIGTERM);
+    sigprocmask(SIG_BLOCK, &blocked, &wait_mask);
+    sigdelset(&wait_mask, SIGINT);
+    sigdelset(&wait_mask, SIGTERM);
+    // ----------------------------------------------------------------------------
+    if (parse_options(argc, argv))
+        return -1;
+
+    // ----------------------------------------------------------------------------
+    // open the tcp listening socket(s) on port 9000, followed by the binary protocol one if
+    // enabled, return -1 on failture
+    int nlisteners = config.shards + (config.binary_port ? 1 : 0);
+    int *listen_fds = calloc(nlisteners, sizeof(int));
+    if (!listen_fds)
+        return -1;
+    for (int i = 0; i < nlisteners; i++) {
+        listen_fds[i] = i < config.shards ? open_listener(9000, config.shards > 1)
+                                          : open_listener(config.binary_port, 0);
+        if (listen_fds[i] < 0) {
+            close_listeners(listen_fds, i);
+            return -1;
+        }
+    }
     // ----------------------------------------------------------------------------
 
-    if (deamon) {
+    if (config.daemon) {
         printf("running as deamon...\n");
         if (fork())
             exit(0);
     }
 
-    // Declare the queue head
-    struct thread_queue queue;
-    // Initialize the head before use
-    TAILQ_INIT(&queue);
-    pthread_mutex_init(&out_file_sync, NULL);
+    // the log thread has to be started in the process that stays (after the daemon fork)
+    if (log_init())
+        log_msg(LOG_WARNING, "Failed to start the log thread, logging synchronously");
+    metrics_init();
+    if (history_init()) {
+        close_listeners(listen_fds, nlisteners);
+        log_shutdown();
+        return -1;
+    }
+    if (timestamp_start()) {
+        history_cleanup();
+        close_listeners(listen_fds, nlisteners);
+        log_shutdown();
+        return -1;
+    }
+    if (config.binary_port && binary_start(listen_fds[config.shards], &wait_mask)) {
+        timestamp_stop();
+        history_cleanup();
+        close_listeners(listen_fds, nlisteners);
+        log_shutdown();
+        return -1;
+    }
+
+    int ret;
+    if (config.shards > 1)
+        ret = run_shards(listen_fds, config.shards, &wait_mask);
+    else
+        ret = run_engine(listen_fds[0], &wait_mask);
+
+    if (config.binary_port)
+        binary_stop();
+    timestamp_stop();
+    history_cleanup();
+    connection_cache_cleanup();
+    close_listeners(listen_fds, nlisteners);
+    log_shutdown();
+    closelog();
+    return ret;
+}
+
+/**
+ * Parses an "AESDCHAR_IOCSEEKTO:X,Y" command from the @param len bytes of @param buffer.
+ * @return 1 if the buffer holds a seek command (then stored in @param seekto), 0 if it is
+ * regular data.
+ */
+int parse_seekto(const uint8_t *buffer, size_t len, struct aesd_seekto *seekto) {
+    char cmd[64];
+    if (len < 19 || memcmp("AESDCHAR_IOCSEEKTO:", buffer, 19) != 0)
+        return 0;
+    log_msg(LOG_DEBUG,"this is an ioctl command: \n");
+    // the received bytes are not NUL terminated
+    len = len < sizeof(cmd) - 1 ? len : sizeof(cmd) - 1;
+    memcpy(cmd, buffer, len);
+    cmd[len] = '\0';
+    seekto->write_cmd = 0;
+    seekto->write_cmd_offset = 0;
+    sscanf(cmd, "AESDCHAR_IOCSEEKTO:%u,%u", &seekto->write_cmd, &seekto->write_cmd_offset);
+    log_msg(LOG_DEBUG,"X: %u, Y:%u !\n", seekto->write_cmd, seekto->write_cmd_offset);
+    return 1;
+}
+
+/**
+ * Tells whether the @param len bytes of @param buffer, the start of a packet whose new line was
+ * not received yet, may still turn into a command: a beginning of a command prefix, or a whole
+ * prefix followed by (part of) its arguments.
+ * @return 1 if the bytes must be kept unconsumed until the rest of the line arrives, 0 if they
+ * are data.
+ */
+int command_pending(const uint8_t *buffer, size_t len) {
+    static const struct {
+        const char *prefix;
+        int args; // the prefix is followed by arguments
+    } commands[] = {
+        {"AESDCHAR_IOCSEEKTO:", 1},
+        {"SINCE:", 1},
+        {"STATS\r", 0},
+    };
+    for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+        size_t n = strlen(commands[i].prefix);
+        if (len > n && !commands[i].args)
+            continue;
+        if (memcmp(commands[i].prefix, buffer, len < n ? len : n) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * Parses a "SINCE:<offset>" command from the @param len bytes of @param buffer, asking for the
+ * history after byte @param since only.
+ * @return 1 if the buffer holds a SINCE command, 0 if it is regular data.
+ */
+int parse_since(const uint8_t *buffer, size_t len, off_t *since) {
+    char cmd[32];
+    long long value = 0;
+    if (len < 6 || memcmp("SINCE:", buffer, 6) != 0)
+        return 0;
+    len = len < sizeof(cmd) - 1 ? len : sizeof(cmd) - 1;
+    memcpy(cmd, buffer, len);
+    cmd[len] = '\0';
+    sscanf(cmd, "SINCE:%lld", &value);
+    *since = value > 0 ? value : 0;
+    log_msg(LOG_DEBUG, "replay since offset %lld", (long long)*since);
+    return 1;
+}
+
+/**
+ * Recognizes a "STATS" command in the @param len bytes of @param buffer.
+ * @return 1 if the buffer holds a STATS command, 0 if it is regular data.
+ */
+int parse_stats(const uint8_t *buffer, size_t len) {
+    return (len == 6 && memcmp("STATS\n", buffer, 6) == 0) ||
+           (len == 7 && memcmp("STATS\r\n", buffer, 7) == 0);
+}
+
+/**
+ * Accounts for the @param len next bytes of the packet being received by @param client_ip
+ * (@param nl_found: they end it) in @param pkt_bytes, the size of the packet so far.
+ * @return 0 if the packet is within config.max_packet, -1 if its connection must be dropped:
+ * the driver (or the log) would otherwise keep growing an unterminated entry.
+ */
+int account_packet(size_t *pkt_bytes, size_t len, int nl_found, const char *client_ip) {
+    *pkt_bytes += len;
+    if (config.max_packet && *pkt_bytes > config.max_packet) {
+        log_msg(LOG_WARNING, "Packet from %s is over %zu bytes, dropping the connection",
+                client_ip, config.max_packet);
+        metrics_add(M_CONN_OVERSIZED, 1);
+        return -1;
+    }
+    if (nl_found)
+        *pkt_bytes = 0;
+    return 0;
+}
+
+/**
+ * Writes the response to a STATS command to @param buffer: the metrics dump (see
+ * metrics_format()), preceded by its "LEN:<n>\n" header in session mode.
+ * @return the length of the response.
+ */
+size_t format_stats_reply(uint8_t *buffer, size_t size) {
+    char stats[BUFSIZ];
+    size_t len = metrics_format(stats, sizeof(stats));
+    size_t header_len = format_reply_header((char *)buffer, size, -1, len);
+    if (len > size - header_len)
+        len = size - header_len;
+    memcpy(buffer + header_len, stats, len);
+    return header_len + len;
+}
+
+/**
+ * Formats the header of a reply of @param len bytes of history into @param header: "LEN:<len>\n"
+ * in session mode, "TAIL:<offset> LEN:<len>\n" for the reply to a SINCE command (@param since
+ * >= 0, the actual start of the reply) so that the client knows where to poll from next time.
+ * @return the length of the header, 0 if the reply has none.
+ */
+int format_reply_header(char *header, size_t size, off_t since, size_t len) {
+    if (since >= 0)
+        return snprintf(header, size, "TAIL:%lld LEN:%zu\n", (long long)(since + len), len);
+    if (config.session)
+        return snprintf(header, size, "LEN:%zu\n", len);
+    return 0;
+}
+
+#if USE_AESD_CHAR_DEVICE == 1
+static int splice_unsupported = 0; // set once the driver rejected a splice()
+#endif
+
+/**
+ * Accounts for @param bytes of history read for the current replay.
+ * @param moved set when splice() already advanced replay_off through replay_offset()
+ */
+static void consume_replay(connection_info *info, size_t bytes, int moved) {
+    if (info->replay_left != SIZE_MAX) // SIZE_MAX: no length limit
+        info->replay_left -= bytes;
+    info->replied += bytes;
+    if (info->replay_off >= 0 && !moved)
+        info->replay_off += bytes;
+}
+
+/**
+ * @return the offset to pass to splice() for the current replay, NULL to read from
+ * the file position.
+ */
+static loff_t *replay_offset(connection_info *info) {
+    return info->replay_off >= 0 ? (loff_t *)&info->replay_off : NULL;
+}
+
+/**
+ * sendfile()s at most @param chunk bytes of the history at info->replay_off, from the data file
+ * of the segment holding them.
+ * @return the number of bytes sent, 0 at the end of the history, -1 on failure.
+ */
+static ssize_t send_segment(connection_info *info, size_t chunk) {
+    struct history_segment *segment = history_segment_get(info->replay_off, 0);
+    if (!segment)
+        return 0;
+    off_t pos;
+    size_t len;
+    int fd = history_segment_fd(segment, info->replay_off, &pos, &len);
+    ssize_t bytes = sendfile(info->fd, fd, &pos, chunk < len ? chunk : len);
+    history_segment_put(segment);
+    return bytes;
+}
+
+/**
+ * Reads at most @param chunk bytes of the history into info->buffer, from the mapping of the
+ * segment holding them (data file) or from the file position (char device).
+ * @return the number of bytes read, 0 at the end of the history, -1 on failure.
+ */
+static ssize_t read_history(connection_info *info, size_t chunk) {
+    if (info->replay_off < 0)
+        return read(info->out_fd, info->buffer, chunk);
+    struct history_segment *segment = history_segment_get(info->replay_off, 0);
+    if (!segment)
+        return 0;
+    size_t len;
+    const char *data = history_segment_data(segment, info->replay_off, &len);
+    chunk = chunk < len ? chunk : len;
+    memcpy(info->buffer, data, chunk);
+    history_segment_put(segment);
+    return chunk;
+}
+
+/**
+ * Picks the cheapest way of copying OUT_FILE to the client socket: sendfile() for the regular
+ * data file, send() straight from the read-only mapping of the char device, a splice() through
+ * a pipe when the driver can't be mapped (as long as it supports splice) and a read()/send()
+ * loop through the connection buffer otherwise.
+ * In session mode (and for a SINCE request) the response is limited to the history present
+ * right now and preceded by a header (see format_reply_header()), so that the client can find
+ * where it ends. A binary read is also limited to info->replay_max bytes and preceded by its
+ * response frame header.
+ */
+void start_replay(connection_info *info) {
+    info->len = 0;
+    info->sent = 0;
+    info->header_len = 0;
+    info->header_sent = 0;
+    info->replied = 0;
+    if (info->stats) { // the response is the metrics dump, sent from the connection buffer
+        info->stats = 0;
+        info->len = format_stats_reply(info->buffer, sizeof(info->buffer));
+        info->replied = info->len;
+        info->replay_left = 0;
+        info->replay_mode = REPLAY_COPY;
+        return;
+    }
+    // a SINCE offset, or the position set by a seek command, -1 for the whole history
+    off_t start = info->since >= 0 ? info->since : info->seek_pos;
+    if (history_replay_window(info->out_fd, config.session || info->binary, &start,
+                              &info->replay_off, &info->replay_left)) {
+        log_msg(LOG_ERR, "Failed to get the size of %s: %s", OUT_FILE, strerror(errno));
+        info->replay_mode = REPLAY_DONE;
+        info->state = CONN_DONE;
+        return;
+    }
+    if (info->replay_left > info->replay_max)
+        info->replay_left = info->replay_max;
+    info->replay_max = SIZE_MAX;
 #if USE_AESD_CHAR_DEVICE != 1
-    setup_timer();
+    info->replay_mode = config.cache_size ? REPLAY_CACHE : REPLAY_SENDFILE;
+#else
+    info->replay_mode = info->replay_off >= 0 ? REPLAY_MAP : REPLAY_COPY;
+    if (info->replay_off < 0 && !splice_unsupported && info->pipe_fds[0] < 0 &&
+        pipe2(info->pipe_fds, O_NONBLOCK | O_CLOEXEC)) {
+        info->pipe_fds[0] = info->pipe_fds[1] = -1;
+    }
+    if (info->replay_off < 0 && !splice_unsupported && info->pipe_fds[0] >= 0)
+        info->replay_mode = REPLAY_SPLICE;
 #endif
 
-    while (run) {
-        // Listen for and accept a connection
-        if (listen(sockfd, 10)) {
-            syslog(LOG_ERR, "Failed to listen on %s:9000 : %s", server_ip,
-                   strerror(errno));
+    if (info->binary)
+        info->header_len = format_frame_header(info->header, info->frame_op, 0,
+                                               info->replay_left);
+    else
+        info->header_len = format_reply_header(info->header, sizeof(info->header),
+                                               info->since >= 0 ? start : -1, info->replay_left);
+    info->since = -1;
+    info->seek_pos = -1;
+}
+
+/**
+ * Starts a reply made of the info->header_len bytes of info->header only (binary responses
+ * without history data).
+ */
+void start_header_reply(connection_info *info) {
+    info->state = CONN_REPLAY;
+    info->len = 0;
+    info->sent = 0;
+    info->header_sent = 0;
+    info->replied = 0;
+    info->replay_left = 0;
+    info->replay_mode = REPLAY_DONE;
+}
+
+/**
+ * Sends the replay window of OUT_FILE to the client, the history is never locked: writers keep
+ * appending while a slow client is served.
+ * @return 1 once the whole response has been sent (or the replay failed), 0 if it has to wait
+ * for the socket to become writable again.
+ */
+static int replay_history(connection_info *info) {
+    ssize_t bytes = 0;
+    int failed = 0;
+
+    // MSG_MORE only when history follows: a lone header would otherwise sit in the socket
+    // until the kernel gives up waiting for more (200 ms)
+    int more = info->replay_mode != REPLAY_DONE && info->replay_left != 0 ? MSG_MORE : 0;
+    while (info->header_sent < info->header_len) {
+        bytes = send(info->fd, info->header + info->header_sent,
+                     info->header_len - info->header_sent, MSG_NOSIGNAL | more);
+        if (bytes < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno == EINTR)
+                continue;
+            info->replay_mode = REPLAY_DONE;
+            failed = 1;
             break;
         }
+        info->header_sent += bytes;
+    }
 
-        struct sockaddr client;
-        socklen_t size = sizeof(client);
-
-        int fd = -1;
-    retry:
-        fd = accept(sockfd, (struct sockaddr *)&client, &size);
-        if (fd < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-            if (!run)
+    while (info->replay_mode != REPLAY_DONE) {
+        size_t chunk;
+        // len - sent: bytes already read from the history but not sent yet
+        if (info->replay_left == 0 && info->len == info->sent) {
+            info->replay_mode = REPLAY_DONE;
+            break;
+        }
+        switch (info->replay_mode) {
+        case REPLAY_CACHE:
+            if (!info->chunk)
+                info->chunk = history_cache_get(info->replay_off);
+            if (!info->chunk) { // dropped from the cache, send this part from the file
+                off_t cached = history_cache_start();
+                chunk = info->replay_left < SENDFILE_CHUNK ? info->replay_left : SENDFILE_CHUNK;
+                if (cached > info->replay_off && cached - info->replay_off < chunk)
+                    chunk = cached - info->replay_off;
+                bytes = send_segment(info, chunk);
+                if (bytes == 0)
+                    info->replay_mode = REPLAY_DONE;
+                else if (bytes > 0)
+                    consume_replay(info, bytes, 0);
                 break;
-            // No incoming connections, continue loop
-            goto retry;
+            }
+            const char *data = history_chunk_data(info->chunk, info->replay_off, &chunk);
+            chunk = info->replay_left < chunk ? info->replay_left : chunk;
+            bytes = send(info->fd, data, chunk, MSG_NOSIGNAL);
+            if (bytes > 0) {
+                consume_replay(info, bytes, 0);
+                if (bytes == chunk) { // done with this chunk (or with the replay)
+                    history_chunk_put(info->chunk);
+                    info->chunk = NULL;
+                }
+            }
+            break;
+        case REPLAY_SENDFILE:
+            chunk = info->replay_left < SENDFILE_CHUNK ? info->replay_left : SENDFILE_CHUNK;
+            bytes = send_segment(info, chunk);
+            if (bytes < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                info->replay_mode = REPLAY_COPY; // not supported for this file, fall back
+                bytes = 0;
+            } else if (bytes == 0) {
+                info->replay_mode = REPLAY_DONE;
+            } else if (bytes > 0) {
+                consume_replay(info, bytes, 0);
+            }
+            break;
+        case REPLAY_MAP: {
+            struct history_segment *map = history_segment_get(info->replay_off, 0);
+            if (!map) { // overwritten by newer packets, cut the replay short
+                info->replay_mode = REPLAY_DONE;
+                break;
+            }
+            const char *data = history_segment_data(map, info->replay_off, &chunk);
+            chunk = info->replay_left < chunk ? info->replay_left : chunk;
+            bytes = send(info->fd, data, chunk, MSG_NOSIGNAL);
+            // the driver may have overwritten that data while it was being sent
+            if (bytes > 0 && !history_segment_get(info->replay_off, 0)) {
+                log_msg(LOG_WARNING, "History overwritten during a replay to %s",
+                        info->client_ip);
+                info->replay_mode = REPLAY_DONE;
+                failed = 1;
+                break;
+            }
+            if (bytes > 0)
+                consume_replay(info, bytes, 0);
+            break;
         }
-
-        char *client_ip;
-        if (fd == -1) {
-            syslog(LOG_ERR, "Failed to connect to client: %s", strerror(errno));
+        case REPLAY_SPLICE:
+            if (info->len == 0) { // pipe drained, move the next chunk of history into it
+                chunk = info->replay_left < SPLICE_CHUNK ? info->replay_left : SPLICE_CHUNK;
+                bytes = splice(info->out_fd, replay_offset(info), info->pipe_fds[1], NULL, chunk,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                if (bytes < 0 && (errno == EINVAL || errno == ENOSYS)) {
+#if USE_AESD_CHAR_DEVICE == 1
+                    log_msg(LOG_DEBUG, "%s does not support splice, replaying through a buffer",
+                            OUT_FILE);
+                    splice_unsupported = 1;
+#endif
+                    info->replay_mode = REPLAY_COPY; // nothing was consumed, fall back
+                    bytes = 0;
+                    break;
+                }
+                if (bytes == 0)
+                    info->replay_mode = REPLAY_DONE;
+                if (bytes <= 0)
+                    break;
+                info->len = bytes;
+                consume_replay(info, bytes, 1);
+            }
+            bytes = splice(info->pipe_fds[0], NULL, info->fd, NULL, info->len,
+                           SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (bytes > 0)
+                info->len -= bytes;
+            break;
+        default: // REPLAY_COPY
+            if (info->sent == info->len) { // everything sent, read the next chunk
+                chunk = info->replay_left < BUFSIZ ? info->replay_left : BUFSIZ;
+                bytes = read_history(info, chunk);
+                if (bytes <= 0) {
+                    info->replay_mode = REPLAY_DONE;
+                    break;
+                }
+                info->len = bytes;
+                info->sent = 0;
+                consume_replay(info, bytes, 0);
+            }
+            bytes = send(info->fd, info->buffer + info->sent, info->len - info->sent,
+                         MSG_NOSIGNAL);
+            if (bytes > 0)
+                info->sent += bytes;
             break;
-        } else {
-            client_ip = malloc(INET_ADDRSTRLEN);
-            inet_ntop(AF_INET, &client, client_ip, INET_ADDRSTRLEN);
-            syslog(LOG_DEBUG, "Accepted connection from %s", client_ip);
         }
 
-        // start the request in a new thread
-        connection_info *info = malloc(sizeof(connection_info));
-        info->fd = fd;
-        info->client_ip = client_ip;
-        pthread_t thread_id;
-        pthread_create(&thread_id, NULL, run_client_request, (void *)info);
-        struct thread_entry *queue_entry = malloc(sizeof(struct thread_entry));
-        queue_entry->thread_id = thread_id;
-        TAILQ_INSERT_TAIL(&queue, queue_entry, entries);
+        if (bytes < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0; // wait until the client can receive more data
+            if (errno == EINTR)
+                continue;
+            info->replay_mode = REPLAY_DONE;
+            failed = 1;
+        }
     }
 
-    // Join all threads by dequeuing their IDs
-    struct thread_entry *t;
-    while (!TAILQ_EMPTY(&queue)) {
-        t = TAILQ_FIRST(&queue);          // Get the first element
-        pthread_join(t->thread_id, NULL); // Join the thread
-        TAILQ_REMOVE(&queue, t,
-                     entries); // Remove the element from the queue
-                               // Free the memory allocated for the element
-        free(t);
+    if (info->chunk) {
+        history_chunk_put(info->chunk);
+        info->chunk = NULL;
     }
-
-    close(sockfd);
-#if USE_AESD_CHAR_DEVICE != 1
-    remove(OUT_FILE);
-#endif
-    closelog();
-    return 0;
+    // in session mode, a short read means the history shrank under us and the announced length
+    // can't be honoured
+    if (info->replay_left != 0 && info->replay_left != SIZE_MAX)
+        failed = 1;
+    if (failed) {
+        log_msg(LOG_ERR, "Failed to send the history to %s: %s", info->client_ip,
+                strerror(errno));
+    } else {
+        metrics_add(M_REPLIES, 1);
+        metrics_add(M_BYTES_OUT, info->header_len + info->replied);
+        metrics_record(H_REPLY_BYTES, info->header_len + info->replied);
+        metrics_record(H_LATENCY_US, (metrics_now() - info->rx_time) / 1000);
+    }
+    // in session mode (and with the binary protocol) the connection stays open for the next
+    // packet
+    info->state = ((config.session || info->binary) && !failed) ? CONN_RECV : CONN_DONE;
+    return 1;
 }
 
-void *run_client_request(void *info) {
-    int fd = ((connection_info *)info)->fd;
-    char *client_ip = ((connection_info *)info)->client_ip;
-    FILE *outf = fopen(OUT_FILE, OUT_RW);
-    int driver_fd = fileno(outf);
-
-    uint8_t buffer[BUFSIZ];
-
-    // read from client until a new line is received
-
-    while (1) {
-        ssize_t bytes = recv(fd, buffer, BUFSIZ, 0);
-        if (bytes <= 0) { // error or connection closed
-            exit(-1);
-        } else {
-            int nl_found = 0;
-            for (int i = 0; i < bytes; i++) {
-                if (buffer[i] == '\n') {
-                    bytes = i + 1;
-                    nl_found = 1;
-                    break;
-                }
+/**
+ * Receives data from the client until a complete packet (ending with a new line) has been
+ * appended to OUT_FILE, or until the connection fails. Data following the new line is kept in
+ * the receive buffer for the next packet of a session.
+ * @return 1 once a packet is complete (or the connection failed), 0 if it has to wait for more
+ * data.
+ */
+static int receive_packet(connection_info *info) {
+    struct frame_slice slice;
+    while (info->state == CONN_RECV) {
+        int more = !frame_next(&info->rx, '\n', &slice); // everything received was processed
+        // the start of a packet may be a command split over several receives: keep it until its
+        // new line arrives, or until it fills the buffer and can only be data
+        if (!more && !slice.complete && info->pkt_bytes == 0 && slice.len < info->rx.size &&
+            command_pending(slice.data, slice.len))
+            more = 1;
+        if (more) {
+            size_t room;
+            uint8_t *dest = frame_space(&info->rx, &room);
+            ssize_t bytes = recv(info->fd, dest, room, 0);
+            if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return 0; // wait for more data
+            if (bytes < 0 && errno == EINTR)
+                continue;
+            if (bytes <= 0) { // error or connection closed
+                log_msg(LOG_DEBUG, "Connection from %s closed before a new line was received",
+                        info->client_ip);
+                info->state = CONN_DONE;
+                break;
             }
-            syslog(LOG_DEBUG,"received %ld bytes and new line found %d\n", bytes, nl_found);
-
-            // TODO: need to add logs here and debug why iocl is not getting triggered
-            // write all received data or untill the new line character.
-            pthread_mutex_lock(&out_file_sync);
-            if (memcmp("AESDCHAR_IOCSEEKTO:", buffer, 19) == 0) {
-                syslog(LOG_DEBUG,"this is an ioctl command: \n");
-                struct aesd_seekto seekto;
-                sscanf((char*) buffer, "AESDCHAR_IOCSEEKTO:%d,%d", &seekto.write_cmd, &seekto.write_cmd_offset);
-                syslog(LOG_DEBUG,"X: %u, Y:%u !\n", seekto.write_cmd, seekto.write_cmd_offset);
-                ioctl(driver_fd, AESDCHAR_IOCSEEKTO, &seekto); 
-            } else {
-                syslog(LOG_DEBUG,"this is a normal write command...\n");
-                fwrite(buffer, 1, bytes, outf);
-                fflush(outf);
+            frame_received(&info->rx, bytes);
+            info->rx_time = metrics_now();
+            continue;
+        }
+
+        if (info->out_fd < 0) {
+            info->out_fd = history_open();
+            if (info->out_fd < 0) {
+                info->state = CONN_DONE;
+                break;
             }
-            pthread_mutex_unlock(&out_file_sync);
+        }
 
-            if (nl_found)
+        // the packet, or what was received of it so far, in place in the receive buffer
+        size_t len = slice.len;
+        int nl_found = slice.complete;
+        log_msg(LOG_DEBUG,"received %zu bytes and new line found %d\n", len, nl_found);
+
+        // write all received data or untill the new line character. Only a whole line received
+        // at the start of a packet can be a command
+        int command = nl_found && info->pkt_bytes == 0;
+        struct aesd_seekto seekto;
+        if (command && parse_seekto(slice.data, len, &seekto)) {
+            if (history_seekto(info->out_fd, &seekto, &info->seek_pos))
+                log_msg(LOG_DEBUG, "Invalid seek from %s: %s", info->client_ip, strerror(errno));
+        } else if (command && parse_stats(slice.data, len)) {
+            info->stats = 1;
+        } else if (!command || !parse_since(slice.data, len, &info->since)) {
+            log_msg(LOG_DEBUG,"this is a normal write command...\n");
+            if (account_packet(&info->pkt_bytes, len, nl_found, info->client_ip)) {
+                info->state = CONN_DONE;
                 break;
+            }
+            if (history_append(info->out_fd, slice.data, len) != len)
+                log_msg(LOG_ERR, "Failed to write to %s: %s", OUT_FILE, strerror(errno));
+            metrics_add(M_BYTES_IN, len);
+            if (nl_found)
+                metrics_add(M_PACKETS_IN, 1);
+        }
+
+        // whatever follows the new line is the start of the next pipelined packet
+        frame_consume(&info->rx, len);
+
+        if (nl_found) {
+            info->state = CONN_REPLAY;
+            start_replay(info);
         }
     }
-    
-
-    // write OUT_FILE contents back to client
-    pthread_mutex_lock(&out_file_sync); // write access shouldn't be allowed
-                                        // while we are reading
-    while (!feof(outf)) {
-        size_t bytes = fread(buffer, 1, BUFSIZ, outf);
-        send(fd, (void *)buffer, bytes, 0);
+    return 1;
+}
+
+/**
+ * Advances the request state machine of the connection @param info as far as possible without
+ * blocking: receives data until a new line is found, then replays the contents of OUT_FILE to
+ * the client. In session mode this repeats for every packet sent on the connection. Binary
+ * protocol connections receive frames instead (see receive_frame()) and always stay open.
+ * @return 1 if the connection is finished and can be closed, 0 if it has to wait for the socket
+ * to become readable/writable again.
+ */
+int run_client_request(connection_info *info) {
+    while (info->state != CONN_DONE) {
+        if (info->state == CONN_RECV) {
+            if (!(info->binary ? receive_frame(info) : receive_packet(info)))
+                return 0;
+        } else if (!replay_history(info)) {
+            return 0;
+        }
     }
-    pthread_mutex_unlock(&out_file_sync); // write access shouldn't be allowed
-                                          // while we are reading
-    fclose(outf);
-
-    close(fd); // close connection
-    syslog(LOG_DEBUG, "Closed connection from %s", client_ip);
-    free(client_ip);
-    free(info);
-    return NULL;
-}
\ No newline at end of file
+    return 1;
+}
@@ -0,0 +1,157 @@
+/*
+ * aesdsocket.h
+ *
+ * Declarations shared between the aesdsocket main program and its connection engines.
+ */
+
+#ifndef AESDSOCKET_H
+#define AESDSOCKET_H
+
+#include <sys/queue.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include "framing.h"
+
+#ifndef USE_AESD_CHAR_DEVICE
+#define USE_AESD_CHAR_DEVICE 1
+#endif
+
+#if USE_AESD_CHAR_DEVICE == 1
+    #define OUT_FILE "/dev/aesdchar"
+#else
+    #define OUT_FILE "/var/tmp/aesdsocketdata" // data file, or directory of the segments
+#endif
+
+enum engine_type {
+    ENGINE_EPOLL, // single threaded epoll reactor
+    ENGINE_POOL,  // fixed size pool of worker threads using blocking sockets
+    ENGINE_URING, // io_uring completion loop (only when built with IO_URING=1)
+};
+
+enum overload_policy {
+    OVERLOAD_WAIT, // stop accepting until a connection finishes (backlog absorbs the burst)
+    OVERLOAD_DROP, // accept and immediately close connections above the in-flight limit
+};
+
+struct server_config {
+    int daemon;
+    int session; // keep connections open and answer every packet (LEN:<n> framed replies)
+    enum engine_type engine;
+    int workers;      // number of worker threads of the pool engine
+    int max_inflight; // maximum number of accepted but not yet finished connections
+    enum overload_policy overload;
+    int sync_writes; // make every append durable (fdatasync) before replying
+    int group_commit; // batch concurrent appends into a single writev() (not io_uring)
+    size_t cache_size; // memory cap of the in-memory history cache, 0 disables it
+    int shards; // number of SO_REUSEPORT listeners, each with its own engine instance
+    int64_t timestamp_interval; // nanoseconds between timestamp records, 0 disables them
+    clockid_t timestamp_clock;  // clock of the timestamp deadlines and records
+    int read_timeout;  // ms a connection may wait for the rest of a packet, 0: no limit
+    int write_timeout; // ms a reply may stay without any progress, 0: no limit
+    size_t max_packet; // bytes a packet may reach before its connection is dropped, 0: no limit
+    int binary_port;   // port of the binary protocol (aesd_binary.h), 0: disabled
+    off_t segment_size;      // log bytes per segment file of the data file
+    int segmented;           // OUT_FILE is a directory of segments (-G, -R, -N or -A)
+    uint64_t retain_bytes;   // history bytes kept before dropping old segments, 0: no limit
+    uint64_t retain_packets; // packets kept before dropping old segments, 0: no limit
+    int64_t retain_age;      // nanoseconds a full segment is kept after its last write, 0: forever
+};
+
+extern struct server_config config;
+extern volatile sig_atomic_t run;
+
+enum conn_state {
+    CONN_RECV,   // receiving the request until a new line is found
+    CONN_REPLAY, // sending the OUT_FILE contents back to the client
+    CONN_DONE,   // request served (or failed), the connection can be closed
+};
+
+enum replay_mode {
+    REPLAY_CACHE,    // send() from the in-memory history cache, sendfile() for evicted parts
+    REPLAY_SENDFILE, // sendfile() from the data file straight to the socket
+    REPLAY_SPLICE,   // splice() from the char device to the socket through a pipe
+    REPLAY_COPY,     // read() into the connection buffer then send()
+    REPLAY_MAP,      // send() straight from the read-only mapping of the char device
+    REPLAY_DONE,
+};
+
+typedef struct connection_info {
+    int fd;
+    int binary; // the connection speaks the binary protocol of aesd_binary.h
+    int out_fd; // history descriptor (see history_open()), opened on the first received chunk
+    char client_ip[INET_ADDRSTRLEN];
+    enum conn_state state;
+    enum replay_mode replay_mode;
+    int pipe_fds[2];    // REPLAY_SPLICE: pipe between the char device and the socket
+    size_t len;         // number of valid bytes in buffer (REPLAY_SPLICE: in the pipe)
+    size_t sent;        // number of bytes of buffer already sent back during the replay
+    off_t replay_off;   // next history offset to replay, -1: the file position (char device)
+    struct history_chunk *chunk; // REPLAY_CACHE: cached chunk being sent
+    size_t replay_left; // bytes of history left to read for this reply, SIZE_MAX: until EOF
+    off_t since;        // start offset requested by a SINCE command, -1: whole history
+    off_t seek_pos;     // history offset set by AESDCHAR_IOCSEEKTO, -1: none
+    size_t replay_max;  // most bytes of history the reply may hold (binary reads)
+    uint8_t *frame;     // binary request payload too large for rx, frame_len bytes
+    size_t frame_len;
+    size_t frame_got;   // bytes of frame received so far
+    uint8_t frame_op;   // opcode of the binary request being served
+    int stats;          // STATS command: the response is the metrics dump
+    uint64_t rx_time;   // metrics_now() when the current data was received
+    uint64_t last_active; // metrics_now() of the last progress, for the idle timeouts
+    size_t pkt_bytes;   // bytes of the current packet received so far
+    size_t replied;     // bytes of the current response sent, header excluded
+    char header[64];    // session mode / SINCE reply header
+    size_t header_len;
+    size_t header_sent;
+    struct frame_rx rx; // received bytes not processed yet, in rx_buffer
+    uint8_t rx_buffer[BUFSIZ];
+    uint8_t buffer[BUFSIZ]; // replay buffer
+    TAILQ_ENTRY(connection_info) entries;
+    struct connection_info *next_free; // free list of the connection objects cache
+} connection_info;
+typedef TAILQ_HEAD(connection_queue, connection_info) connection_queue_head_t;
+
+struct aesd_seekto;
+int parse_seekto(const uint8_t *buffer, size_t len, struct aesd_seekto *seekto);
+int command_pending(const uint8_t *buffer, size_t len);
+int parse_since(const uint8_t *buffer, size_t len, off_t *since);
+int format_reply_header(char *header, size_t size, off_t since, size_t len);
+int parse_stats(const uint8_t *buffer, size_t len);
+int account_packet(size_t *pkt_bytes, size_t len, int nl_found, const char *client_ip);
+size_t format_stats_reply(uint8_t *buffer, size_t size);
+
+connection_info *new_connection(int fd, const struct sockaddr_in *client, int binary);
+void close_connection(connection_info *info);
+void connection_cache_cleanup(void);
+int run_client_request(connection_info *info);
+void start_replay(connection_info *info);
+void start_header_reply(connection_info *info);
+
+int receive_frame(connection_info *info);
+size_t format_frame_header(char *header, uint8_t opcode, uint8_t status, uint32_t len);
+int binary_start(int listen_fd, const sigset_t *wait_mask);
+void binary_stop(void);
+
+/**
+ * Connection engines: serve clients connecting to the listening socket @param listen_fd until
+ * `run` is cleared. SIGINT/SIGTERM are blocked by the caller and must only be unblocked (using
+ * @param wait_mask) while sleeping, so that a shutdown request can never be missed.
+ * @return 0 on a clean shutdown, -1 on failure.
+ */
+int run_reactor(int listen_fd, const sigset_t *wait_mask);
+int run_binary_reactor(int listen_fd, const sigset_t *wait_mask);
+int run_pool(int listen_fd, const sigset_t *wait_mask);
+int run_uring(int listen_fd, const sigset_t *wait_mask);
+int run_engine(int listen_fd, const sigset_t *wait_mask);
+
+/**
+ * Runs one instance of the configured engine per socket of @param listen_fds (@param nshards
+ * SO_REUSEPORT listeners sharing the port), each on a thread pinned to a CPU.
+ * @return 0 on a clean shutdown, -1 if a shard failed.
+ */
+int run_shards(const int *listen_fds, int nshards, const sigset_t *wait_mask);
+
+#endif /* AESDSOCKET_H */
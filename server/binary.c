@@ -0,0 +1,287 @@
+/**
+ * @file binary.c
+ * @brief Binary protocol of aesdsocket (see aesd_binary.h)
+ *
+ * Binary connections are served by the epoll engine, on a thread of its own listening on
+ * config.binary_port. Frames are length prefixed, so payloads may hold new lines and no byte
+ * is scanned to find where a request ends. A request that fits in the receive buffer is
+ * decoded in place, a larger one (a batch of thousands of records) gets a buffer of its own,
+ * bounded by AESD_FRAME_MAX (or config.max_packet).
+ *
+ * The records of an APPEND batch are written with a single reservation and writev(), reads
+ * go through the replay path of the text protocol (cache, sendfile or splice).
+ */
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include <endian.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "aesd_binary.h"
+#include "aesd_ioctl.h"
+#include "aesdsocket.h"
+#include "history.h"
+#include "metrics.h"
+#include "log.h"
+
+#define RECORDS_ON_STACK 64 // iovecs of a batch kept on the stack, larger batches malloc() them
+
+static struct {
+    pthread_t thread;
+    int listen_fd;
+    const sigset_t *wait_mask;
+} binary;
+
+static uint32_t get_u32(const uint8_t *buf) {
+    uint32_t value;
+    memcpy(&value, buf, sizeof(value));
+    return ntohl(value);
+}
+
+static uint64_t get_u64(const uint8_t *buf) {
+    uint64_t value;
+    memcpy(&value, buf, sizeof(value));
+    return be64toh(value);
+}
+
+/**
+ * Writes the header of a response frame of @param len payload bytes to @param header.
+ * @return the length of the header.
+ */
+size_t format_frame_header(char *header, uint8_t opcode, uint8_t status, uint32_t len) {
+    struct aesd_frame frame = {.len = htonl(len), .opcode = opcode, .status = status};
+    memcpy(header, &frame, sizeof(frame));
+    return sizeof(frame);
+}
+
+/**
+ * Answers the current request with an empty response of status @param status.
+ */
+static void reply_status(connection_info *info, int status) {
+    info->header_len = format_frame_header(info->header, info->frame_op, status, 0);
+    start_header_reply(info);
+}
+
+/**
+ * Appends the records of the APPEND payload of @param len bytes at @param payload, and answers
+ * with where they were written.
+ */
+static void append_records(connection_info *info, const uint8_t *payload, size_t len) {
+    int count = 0;
+    for (size_t pos = 0; pos < len; count++) {
+        if (len - pos < 4 || get_u32(payload + pos) > len - pos - 4) {
+            log_msg(LOG_DEBUG, "Malformed APPEND frame from %s", info->client_ip);
+            reply_status(info, EINVAL);
+            return;
+        }
+        pos += 4 + get_u32(payload + pos);
+    }
+
+    struct iovec stack_iov[RECORDS_ON_STACK];
+    struct iovec *iov = stack_iov;
+    if (count > RECORDS_ON_STACK && !(iov = malloc(count * sizeof(struct iovec)))) {
+        reply_status(info, ENOMEM);
+        return;
+    }
+    size_t pos = 0;
+    for (int i = 0; i < count; i++) {
+        iov[i].iov_len = get_u32(payload + pos);
+        iov[i].iov_base = (void *)(payload + pos + 4);
+        pos += 4 + iov[i].iov_len;
+    }
+    off_t off = -1;
+    ssize_t written = count ? history_appendv(info->out_fd, iov, count, &off) : 0;
+    int err = errno;
+    if (iov != stack_iov)
+        free(iov);
+    if (written < 0) {
+        log_msg(LOG_ERR, "Failed to write to %s: %s", OUT_FILE, strerror(err));
+        reply_status(info, err ? err : EIO);
+        return;
+    }
+    metrics_add(M_PACKETS_IN, count);
+    metrics_add(M_BYTES_IN, written);
+
+    uint64_t first = off >= 0 ? htobe64(off) : UINT64_MAX;
+    uint32_t records = htonl(count);
+    size_t header_len = format_frame_header(info->header, info->frame_op, 0,
+                                            sizeof(first) + sizeof(records));
+    memcpy(info->header + header_len, &first, sizeof(first));
+    memcpy(info->header + header_len + sizeof(first), &records, sizeof(records));
+    info->header_len = header_len + sizeof(first) + sizeof(records);
+    start_header_reply(info);
+}
+
+/**
+ * Runs the request info->frame_op whose payload is the @param len bytes at @param payload, and
+ * starts its response.
+ */
+static void process_frame(connection_info *info, const uint8_t *payload, size_t len) {
+    if (info->out_fd < 0) {
+        info->out_fd = history_open();
+        if (info->out_fd < 0) {
+            info->state = CONN_DONE;
+            return;
+        }
+    }
+
+    switch (info->frame_op) {
+    case AESD_OP_APPEND:
+        append_records(info, payload, len);
+        break;
+    case AESD_OP_READ: {
+        if (len != 12) {
+            reply_status(info, EINVAL);
+            break;
+        }
+        uint64_t off = get_u64(payload);
+        info->since = off > INT64_MAX ? INT64_MAX : (off_t)off;
+        info->replay_max = get_u32(payload + 8);
+        info->state = CONN_REPLAY;
+        start_replay(info);
+        break;
+    }
+    case AESD_OP_SEEK_READ: {
+        if (len != 12) {
+            reply_status(info, EINVAL);
+            break;
+        }
+        struct aesd_seekto seekto = {
+            .write_cmd = get_u32(payload),
+            .write_cmd_offset = get_u32(payload + 4),
+        };
+        if (history_seekto(info->out_fd, &seekto, &info->seek_pos)) {
+            reply_status(info, errno);
+            break;
+        }
+        info->since = -1; // read from the new position
+        info->replay_max = get_u32(payload + 8);
+        info->state = CONN_REPLAY;
+        start_replay(info);
+        break;
+    }
+    default:
+        log_msg(LOG_DEBUG, "Unknown opcode %d from %s", info->frame_op, info->client_ip);
+        reply_status(info, EINVAL);
+        break;
+    }
+}
+
+/**
+ * Receives data from a binary protocol client until a complete request frame has been
+ * received and run, or until the connection fails. Data following the frame is kept in the
+ * receive buffer for the next (pipelined) request.
+ * @return 1 once a request has been run (or the connection failed), 0 if it has to wait for
+ * more data.
+ */
+int receive_frame(connection_info *info) {
+    const size_t max_payload = config.max_packet && config.max_packet < AESD_FRAME_MAX
+                                   ? config.max_packet
+                                   : AESD_FRAME_MAX;
+    while (info->state == CONN_RECV) {
+        size_t pending = frame_pending(&info->rx), room = 0;
+        uint8_t *dest = NULL;
+        if (info->frame) { // large payload, received in its own buffer
+            if (info->frame_got == info->frame_len) {
+                process_frame(info, info->frame, info->frame_len);
+                free(info->frame);
+                info->frame = NULL;
+                continue;
+            }
+            dest = info->frame + info->frame_got;
+            room = info->frame_len - info->frame_got;
+        } else if (pending >= sizeof(struct aesd_frame)) {
+            const uint8_t *head = frame_head(&info->rx);
+            struct aesd_frame frame;
+            memcpy(&frame, head, sizeof(frame));
+            size_t payload_len = ntohl(frame.len);
+            size_t frame_len = sizeof(frame) + payload_len;
+            info->frame_op = frame.opcode;
+            if (payload_len > max_payload) {
+                log_msg(LOG_WARNING, "Frame from %s is over %zu bytes, dropping the connection",
+                        info->client_ip, max_payload);
+                metrics_add(M_CONN_OVERSIZED, 1);
+                info->state = CONN_DONE;
+                break;
+            }
+            if (pending >= frame_len) { // the whole frame is there, run it in place
+                process_frame(info, head + sizeof(frame), payload_len);
+                frame_consume(&info->rx, frame_len);
+                continue;
+            }
+            if (frame_len > BUFSIZ) { // rx only holds the start of this frame
+                info->frame = malloc(payload_len);
+                if (!info->frame) {
+                    log_msg(LOG_ERR, "Out of memory for a frame from %s", info->client_ip);
+                    info->state = CONN_DONE;
+                    break;
+                }
+                info->frame_len = payload_len;
+                info->frame_got = pending - sizeof(frame);
+                memcpy(info->frame, head + sizeof(frame), info->frame_got);
+                frame_consume(&info->rx, pending);
+                continue;
+            }
+        }
+        if (!info->frame) // the rest of a frame that fits in rx
+            dest = frame_space(&info->rx, &room);
+
+        ssize_t bytes = recv(info->fd, dest, room, 0);
+        if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0; // wait for more data
+        if (bytes < 0 && errno == EINTR)
+            continue;
+        if (bytes <= 0) { // error or connection closed
+            if (pending || info->frame)
+                log_msg(LOG_DEBUG, "Connection from %s closed in the middle of a frame",
+                        info->client_ip);
+            info->state = CONN_DONE;
+            break;
+        }
+        if (info->frame)
+            info->frame_got += bytes;
+        else
+            frame_received(&info->rx, bytes);
+        info->rx_time = metrics_now();
+    }
+    return 1;
+}
+
+static void *binary_main(void *arg) {
+    run_binary_reactor(binary.listen_fd, binary.wait_mask);
+    // the signal that stopped this engine may only have been delivered to this thread: pass
+    // it on to the main engine, as the shards do
+    run = 0;
+    kill(getpid(), SIGTERM);
+    return NULL;
+}
+
+/**
+ * Starts serving the binary protocol clients of @param listen_fd on a thread of its own.
+ * @return 0 on success, -1 on failure.
+ */
+int binary_start(int listen_fd, const sigset_t *wait_mask) {
+    binary.listen_fd = listen_fd;
+    binary.wait_mask = wait_mask;
+    int err = pthread_create(&binary.thread, NULL, binary_main, NULL);
+    if (err) {
+        log_msg(LOG_ERR, "Failed to start the binary protocol thread: %s", strerror(err));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Stops the binary protocol thread, once `run` has been cleared.
+ */
+void binary_stop(void) {
+    // wake it up in case the signal that stopped the main engine didn't reach it
+    pthread_kill(binary.thread, SIGTERM);
+    pthread_join(binary.thread, NULL);
+}
@@ -0,0 +1,103 @@
+/**
+ * @file bqueue.c
+ * @brief Bounded multi-producer / multi-consumer FIFO queue of pointers
+ *
+ * A fixed size ring protected by a mutex, producers sleep while the queue is full and consumers
+ * sleep while it is empty.
+ */
+
+#include <stdlib.h>
+#include "bqueue.h"
+
+/**
+ * Initializes @param q to hold at most @param capacity items.
+ * @return 0 on success, -1 if the storage could not be allocated.
+ */
+int bqueue_init(struct bqueue *q, size_t capacity) {
+    q->items = calloc(capacity, sizeof(void *));
+    if (!q->items)
+        return -1;
+    q->capacity = capacity;
+    q->head = 0;
+    q->count = 0;
+    q->closed = 0;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+    return 0;
+}
+
+void bqueue_destroy(struct bqueue *q) {
+    pthread_cond_destroy(&q->not_full);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_mutex_destroy(&q->lock);
+    free(q->items);
+}
+
+/**
+ * Appends @param item to the queue, waiting for room if the queue is full.
+ * @return 0 on success, -1 if the queue has been closed.
+ */
+int bqueue_push(struct bqueue *q, void *item) {
+    pthread_mutex_lock(&q->lock);
+    while (q->count == q->capacity && !q->closed)
+        pthread_cond_wait(&q->not_full, &q->lock);
+    if (q->closed) {
+        pthread_mutex_unlock(&q->lock);
+        return -1;
+    }
+    q->items[(q->head + q->count) % q->capacity] = item;
+    q->count++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+}
+
+static void *bqueue_take(struct bqueue *q) {
+    void *item = q->items[q->head];
+    q->head = (q->head + 1) % q->capacity;
+    q->count--;
+    pthread_cond_signal(&q->not_full);
+    return item;
+}
+
+/**
+ * Removes the oldest item from the queue, waiting for one if the queue is empty.
+ * @return the item, or NULL once the queue has been closed.
+ */
+void *bqueue_pop(struct bqueue *q) {
+    void *item = NULL;
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0 && !q->closed)
+        pthread_cond_wait(&q->not_empty, &q->lock);
+    if (!q->closed)
+        item = bqueue_take(q);
+    pthread_mutex_unlock(&q->lock);
+    return item;
+}
+
+/**
+ * Removes the oldest item from the queue without waiting, this also works on a closed queue so
+ * that the remaining items can be released.
+ * @return the item, or NULL if the queue is empty.
+ */
+void *bqueue_try_pop(struct bqueue *q) {
+    void *item = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->count)
+        item = bqueue_take(q);
+    pthread_mutex_unlock(&q->lock);
+    return item;
+}
+
+/**
+ * Closes the queue: wakes up every waiting producer and consumer, further pushes fail and pops
+ * return NULL.
+ */
+void bqueue_close(struct bqueue *q) {
+    pthread_mutex_lock(&q->lock);
+    q->closed = 1;
+    pthread_cond_broadcast(&q->not_empty);
+    pthread_cond_broadcast(&q->not_full);
+    pthread_mutex_unlock(&q->lock);
+}
@@ -0,0 +1,31 @@
+/*
+ * bqueue.h
+ *
+ * Bounded multi-producer / multi-consumer FIFO queue of pointers.
+ */
+
+#ifndef BQUEUE_H
+#define BQUEUE_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+struct bqueue {
+    void **items;
+    size_t capacity;
+    size_t head;  // index of the oldest item
+    size_t count; // number of items currently queued
+    int closed;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+};
+
+int bqueue_init(struct bqueue *q, size_t capacity);
+void bqueue_destroy(struct bqueue *q);
+int bqueue_push(struct bqueue *q, void *item);
+void *bqueue_pop(struct bqueue *q);
+void *bqueue_try_pop(struct bqueue *q);
+void bqueue_close(struct bqueue *q);
+
+#endif /* BQUEUE_H */
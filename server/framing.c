@@ -0,0 +1,160 @@
+/**
+ * @file framing.c
+ * @brief Splitting of the received byte stream of a connection into packets
+ *
+ * Packets end with a delimiter (a new line) and arrive in arbitrary pieces: a receive buffer may
+ * hold the end of one packet followed by several others, or only a small part of a multi
+ * megabyte packet. struct frame_rx hands out what was received as slices of its buffer, in
+ * place: every complete packet (or the end of one) up to its delimiter, then whatever was
+ * received of the next one, so that a large packet is streamed BUFSIZ bytes at a time instead of
+ * being buffered. Consuming a slice only moves an index, the buffer is compacted only when the
+ * connection needs room to receive more.
+ *
+ * The search compares 32 (AVX2) or 16 (SSE2) bytes at a time. The implementation is picked
+ * once, from what the CPU supports, the scalar loop is used on other architectures.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "framing.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FRAMING_X86 1
+#endif
+
+static const uint8_t *find_scalar(const uint8_t *buffer, size_t len, uint8_t delim) {
+    for (size_t i = 0; i < len; i++) {
+        if (buffer[i] == delim)
+            return buffer + i;
+    }
+    return NULL;
+}
+
+#ifdef FRAMING_X86
+__attribute__((target("sse2")))
+static const uint8_t *find_sse2(const uint8_t *buffer, size_t len, uint8_t delim) {
+    const __m128i needle = _mm_set1_epi8((char)delim);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(buffer + i));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, needle));
+        if (mask)
+            return buffer + i + __builtin_ctz(mask);
+    }
+    return find_scalar(buffer + i, len - i, delim);
+}
+
+__attribute__((target("avx2")))
+static const uint8_t *find_avx2(const uint8_t *buffer, size_t len, uint8_t delim) {
+    const __m256i needle = _mm256_set1_epi8((char)delim);
+    size_t i = 0;
+    // two vectors per iteration: a single test covers 64 bytes
+    for (; i + 64 <= len; i += 64) {
+        __m256i lo = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(buffer + i)), needle);
+        __m256i hi =
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(buffer + i + 32)), needle);
+        if (!_mm256_testz_si256(_mm256_or_si256(lo, hi), _mm256_or_si256(lo, hi))) {
+            uint32_t mask = (uint32_t)_mm256_movemask_epi8(lo);
+            if (mask)
+                return buffer + i + __builtin_ctz(mask);
+            return buffer + i + 32 + __builtin_ctz((uint32_t)_mm256_movemask_epi8(hi));
+        }
+    }
+    for (; i + 32 <= len; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(buffer + i));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, needle));
+        if (mask)
+            return buffer + i + __builtin_ctz(mask);
+    }
+    return find_sse2(buffer + i, len - i, delim);
+}
+#endif
+
+typedef const uint8_t *(*find_fn)(const uint8_t *, size_t, uint8_t);
+
+static find_fn select_find(void) {
+#ifdef FRAMING_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return find_avx2;
+    if (__builtin_cpu_supports("sse2"))
+        return find_sse2;
+#endif
+    return find_scalar;
+}
+
+/**
+ * Looks for the first @param delim in the @param len bytes of @param buffer.
+ * @return its address, NULL if there is none.
+ */
+const uint8_t *frame_find(const uint8_t *buffer, size_t len, uint8_t delim) {
+    // threads racing on the first call all store the same function
+    static find_fn find = NULL;
+    find_fn fn = __atomic_load_n(&find, __ATOMIC_RELAXED);
+    if (!fn) {
+        fn = select_find();
+        __atomic_store_n(&find, fn, __ATOMIC_RELAXED);
+    }
+    return fn(buffer, len, delim);
+}
+
+/**
+ * Sets up @param rx to receive into the @param size bytes of @param data.
+ */
+void frame_init(struct frame_rx *rx, uint8_t *data, size_t size) {
+    rx->data = data;
+    rx->size = size;
+    rx->start = rx->end = 0;
+}
+
+/**
+ * Makes room to receive more data into @param rx, moving the bytes not consumed yet to the
+ * start of the buffer if they are not there already.
+ * @param room: set to the number of bytes that can be received.
+ * @return where to receive them.
+ */
+uint8_t *frame_space(struct frame_rx *rx, size_t *room) {
+    if (rx->start > 0) {
+        memmove(rx->data, rx->data + rx->start, rx->end - rx->start);
+        rx->end -= rx->start;
+        rx->start = 0;
+    }
+    *room = rx->size - rx->end;
+    return rx->data + rx->end;
+}
+
+/**
+ * Adds the @param len bytes received at frame_space() to @param rx.
+ */
+void frame_received(struct frame_rx *rx, size_t len) {
+    rx->end += len;
+}
+
+/**
+ * Gets the next piece of packet received in @param rx, up to its first @param delim, without
+ * consuming it.
+ * @param slice: set to the piece, which stays valid until frame_space() is called.
+ * @return 1 if there is one, 0 if every received byte was consumed.
+ */
+int frame_next(const struct frame_rx *rx, uint8_t delim, struct frame_slice *slice) {
+    size_t pending = rx->end - rx->start;
+    if (pending == 0)
+        return 0;
+    const uint8_t *data = rx->data + rx->start;
+    const uint8_t *end = frame_find(data, pending, delim);
+    slice->data = data;
+    slice->len = end ? (size_t)(end - data) + 1 : pending;
+    slice->complete = end != NULL;
+    return 1;
+}
+
+/**
+ * Consumes the first @param len pending bytes of @param rx (the slice handed out last).
+ */
+void frame_consume(struct frame_rx *rx, size_t len) {
+    rx->start += len;
+    if (rx->start == rx->end) // nothing left, receive at the start of the buffer again
+        rx->start = rx->end = 0;
+}
@@ -0,0 +1,58 @@
+/*
+ * framing.h
+ *
+ * Splitting of the received byte stream of a connection into packets.
+ */
+
+#ifndef FRAMING_H
+#define FRAMING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Receive buffer of a connection: bytes are received after end, and consumed from start as the
+ * packets they hold are handed out. Everything is used in place, the buffer is only compacted
+ * when more room is needed to receive.
+ */
+struct frame_rx {
+    uint8_t *data; // buffer of size bytes
+    size_t size;
+    size_t start; // first byte not consumed yet
+    size_t end;   // end of the received bytes
+};
+
+/**
+ * A piece of a packet, pointing into the receive buffer: either a whole packet (or the end of
+ * one) up to and including its delimiter, or everything received so far of a packet that isn't
+ * complete yet.
+ */
+struct frame_slice {
+    const uint8_t *data;
+    size_t len;
+    int complete; // 1 if the slice ends with the delimiter
+};
+
+const uint8_t *frame_find(const uint8_t *buffer, size_t len, uint8_t delim);
+
+void frame_init(struct frame_rx *rx, uint8_t *data, size_t size);
+uint8_t *frame_space(struct frame_rx *rx, size_t *room);
+void frame_received(struct frame_rx *rx, size_t len);
+int frame_next(const struct frame_rx *rx, uint8_t delim, struct frame_slice *slice);
+void frame_consume(struct frame_rx *rx, size_t len);
+
+/**
+ * @return the number of received bytes not consumed yet.
+ */
+static inline size_t frame_pending(const struct frame_rx *rx) {
+    return rx->end - rx->start;
+}
+
+/**
+ * @return the first received byte not consumed yet.
+ */
+static inline const uint8_t *frame_head(const struct frame_rx *rx) {
+    return rx->data + rx->start;
+}
+
+#endif /* FRAMING_H */
@@ -0,0 +1,1413 @@
+/**
+ * @file history.c
+ * @brief Access to the history of received packets stored in OUT_FILE
+ *
+ * With the char device backend every connection opens the device, the driver serializes the
+ * writes and keeps the file position used by AESDCHAR_IOCSEEKTO. When the driver supports it,
+ * the device is also mapped read-only once: replays then send the history straight from the
+ * mapping, addressed by stream offsets.
+ *
+ * With the data file backend OUT_FILE holds an append log shared by all the connections. A
+ * writer reserves a range at the end of the log with an atomic add, writes it with pwrite() and
+ * then commits it. The committed length only moves over ranges that are completely written, in
+ * reservation order, and is published atomically: a reader snapshots it and replays up to it
+ * with positional reads, without taking any lock. A slow reader never delays a writer and
+ * writers only serialize for the few instructions needed to publish their range.
+ *
+ * With config.segmented, OUT_FILE is a directory and the log is split in segments of
+ * config.segment_size bytes, each one a data file named after its start offset, so that finding
+ * the file holding an offset is a division. Otherwise OUT_FILE is the single data file of the log
+ * (a segment of HISTORY_FILE_SIZE bytes, grown as it is written). Next to each data file, a
+ * sidecar index file holds the end offset of every entry (packet terminated by a new line)
+ * ending in that segment. Both are memory mapped. The committed data is indexed by the
+ * thread that committed it, so "write command X, offset Y" (AESDCHAR_IOCSEEKTO) is resolved by a
+ * binary search over the segments and a single index read, however long the history is.
+ *
+ * The history is bounded by rotating segments out: once the segments after the oldest one hold
+ * config.retain_bytes bytes or config.retain_packets packets, or the oldest one is full and was
+ * not written for config.retain_age, it is dropped and the history starts at the next packet
+ * boundary. Dropping is O(1), whatever the size of the segment: its slot is skipped and its files
+ * are unlinked, replays still reading it keep it mapped until they are done. The segment being
+ * written is never dropped, so the limits are honoured at segment granularity.
+ *
+ * The data file history is also kept in memory, in a chain of reference counted chunks of
+ * HISTORY_CHUNK_SIZE bytes covering consecutive ranges of the log. Writers copy their range
+ * into the chunks before committing it, so everything below the committed length is complete
+ * in the cached chunks. Replays are served from the chunks, and the oldest chunks are dropped
+ * once the cache grows over config.cache_size: a replay then reads the dropped part from the
+ * segment files. A reader keeps a reference on the chunk it is sending, so dropping a chunk never
+ * invalidates a replay in progress.
+ *
+ * With config.group_commit, concurrent appends are queued and written in batches: one writer at
+ * a time takes everything queued and issues a single writev() for it (followed by a single
+ * fdatasync() with config.sync_writes), and every writer returns once its batch is written.
+ */
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "aesd_ioctl.h"
+#include "aesdsocket.h"
+#include "history.h"
+#include "metrics.h"
+#include "log.h"
+
+#if USE_AESD_CHAR_DEVICE != 1
+/**
+ * A written range that could not be committed yet because an earlier reservation is still
+ * being written.
+ */
+struct pending_range {
+    off_t off;
+    size_t len;
+    struct pending_range *next;
+};
+
+struct history_chunk {
+    off_t start; // log offset of data[0]
+    int refs;    // the cache holds one reference while the chunk is part of it
+    struct history_chunk *next_spare;
+    char data[HISTORY_CHUNK_SIZE];
+};
+
+#define SPARE_CHUNKS 8 // released chunks kept for reuse instead of being freed
+
+static struct {
+    pthread_mutex_t lock;
+    struct history_chunk **chunks; // chunks[i] covers chunk number first + i
+    size_t first;      // number of the oldest cached chunk
+    size_t count;      // number of cached chunks
+    size_t capacity;   // size of the chunks array
+    size_t max_chunks; // memory cap, 0 when the cache is disabled
+} cache;
+
+/**
+ * Chunks dropped from the cache and released by their last reader, reused for the next chunks
+ * so that a full cache rolling over doesn't malloc()/free() 64 KiB for every chunk.
+ */
+static struct {
+    pthread_mutex_t lock;
+    struct history_chunk *list;
+    int count;
+} spares = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+#define INDEX_MIN_ENTRIES 4096 // initial capacity of a segment index, doubled when it fills up
+#define SEGMENT_NAME_SIZE 64   // file names of the segments, see segment_name()
+
+/**
+ * The log range [start, start + config.segment_size): a data file, and an index file holding
+ * the end offset of every entry ending in the range.
+ */
+struct history_segment {
+    off_t start;      // log offset of the first byte of the segment
+    int fd;           // data file, sized to config.segment_size up front (sparse) if segmented
+    const char *data; // read only mapping of the data file
+    int index_fd;
+    uint64_t *index;  // mapping of the index file, index_capacity end offsets
+    size_t index_capacity;
+    size_t entries;   // number of end offsets published in index
+    uint64_t last_write; // metrics_now() when data ending in the segment was last indexed
+    int refs;         // the segment table holds one reference while the segment is part of it
+};
+
+/**
+ * A segment of the log, and where its first entry stands in the packet index.
+ */
+struct segment_slot {
+    struct history_segment *segment; // NULL until written to (or if it could not be created)
+    uint64_t first_entry; // number of the first entry ending in the segment, once indexed
+    off_t first_start;    // log offset where that entry starts
+};
+
+static struct {
+    pthread_mutex_t lock; // protects the slots and the publication of index entries
+    int dir_fd;           // directory of the data files
+    const char *name;     // file name of OUT_FILE, without config.segmented
+    struct segment_slot *slots; // slots[head + i] describes segment number first + i
+    size_t head;          // slots before it belonged to dropped segments
+    size_t first;         // number of the oldest segment
+    size_t count;         // number of slots in use
+    size_t capacity;      // size of the slots array
+    size_t indexed_slots; // slots whose first_entry is set
+    uint64_t entries;     // number of entries published in the index, dropped ones included
+    uint64_t first_entry; // number of the oldest retained entry
+    off_t log_start;      // start of the retained history
+    pthread_mutex_t index_lock; // held by the thread indexing newly committed data
+    off_t indexed;        // end of the indexed part of the log
+    off_t entry_start;    // start of the entry being indexed (after the last new line)
+} segments = {.dir_fd = -1};
+
+static struct {
+    off_t reserved;  // end of the last reserved range
+    off_t committed; // end of the readable history
+    pthread_mutex_t commit_lock; // protects pending, spare_ranges and the update of committed
+    pthread_cond_t committed_moved; // broadcast to commit_waiters when committed moves
+    int commit_waiters; // writers waiting for their turn to commit, see commit_range()
+    struct pending_range *pending; // sorted by offset
+    struct pending_range *spare_ranges; // released pending ranges, reused before malloc()
+} append_log;
+
+/**
+ * Deletes OUT_FILE, the data file and its index or the directory of segment files left in it
+ * (by a previous run).
+ */
+static void remove_log(void) {
+    remove(OUT_FILE ".idx");
+    DIR *dir = opendir(OUT_FILE);
+    if (!dir) { // nothing there, or the single data file
+        remove(OUT_FILE);
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] != '.')
+            unlinkat(dirfd(dir), entry->d_name, 0);
+    }
+    closedir(dir);
+    rmdir(OUT_FILE);
+}
+
+/**
+ * Sets @param name to the file name of the data (@param ext "log") or index ("idx") file of the
+ * segment starting at @param start, in segments.dir_fd.
+ */
+static void segment_name(char *name, size_t size, off_t start, const char *ext) {
+    if (config.segmented)
+        snprintf(name, size, "%020lld.%s", (long long)start, ext);
+    else if (start == 0) // OUT_FILE and OUT_FILE.idx
+        snprintf(name, size, "%s%s", segments.name, strcmp(ext, "idx") ? "" : ".idx");
+    else // the history outgrew HISTORY_FILE_SIZE
+        snprintf(name, size, "%s.%lld%s", segments.name, (long long)start,
+                 strcmp(ext, "idx") ? "" : ".idx");
+}
+
+static void segment_unlink(off_t start) {
+    char name[SEGMENT_NAME_SIZE];
+    segment_name(name, sizeof(name), start, "log");
+    unlinkat(segments.dir_fd, name, 0);
+    segment_name(name, sizeof(name), start, "idx");
+    unlinkat(segments.dir_fd, name, 0);
+}
+#else
+/**
+ * The read-only mapping of the char device (struct aesd_mmap_header), when the driver supports
+ * it. Replays are sent straight from it, as if the history were a single segment addressed by
+ * stream offsets (see aesd_ioctl.h).
+ */
+struct history_segment {
+    const struct aesd_mmap_header *header;
+    const char *data; // the data ring
+    size_t len;       // length of the mapping
+};
+
+static struct history_segment device_map;
+
+/**
+ * Maps OUT_FILE read-only if it is a char device that supports it, replays otherwise read() it.
+ */
+static void map_device(void) {
+    struct stat st;
+    int fd = open(OUT_FILE, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) || !S_ISCHR(st.st_mode)) {
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+    const struct aesd_mmap_header *header =
+        mmap(NULL, AESD_MMAP_HEADER_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+    if (header == MAP_FAILED) {
+        log_msg(LOG_DEBUG, "%s can't be mapped, replaying through read()", OUT_FILE);
+        close(fd);
+        return;
+    }
+    if (header->magic == AESD_MMAP_MAGIC) {
+        size_t len = AESD_MMAP_HEADER_SIZE + header->data_size;
+        void *map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+        if (map != MAP_FAILED) {
+            device_map.header = map;
+            device_map.data = (const char *)map + AESD_MMAP_HEADER_SIZE;
+            device_map.len = len;
+        }
+    }
+    munmap((void *)header, AESD_MMAP_HEADER_SIZE);
+    close(fd);
+}
+
+/**
+ * Reads the history window published in the device mapping, retrying while the driver updates
+ * it.
+ * @param history: set to the stream offset of file position 0.
+ * @param first: set to the stream offset of the oldest byte in the mapping.
+ * @param end: set to the stream offset of the end of the history.
+ */
+static void map_window(uint64_t *history, uint64_t *first, uint64_t *end) {
+    const struct aesd_mmap_header *header = device_map.header;
+    uint64_t generation;
+    do {
+        generation = __atomic_load_n(&header->generation, __ATOMIC_ACQUIRE);
+        *history = __atomic_load_n(&header->history_offset, __ATOMIC_RELAXED);
+        *first = __atomic_load_n(&header->first_offset, __ATOMIC_RELAXED);
+        *end = __atomic_load_n(&header->end_offset, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((generation & 1) ||
+             generation != __atomic_load_n(&header->generation, __ATOMIC_RELAXED));
+}
+#endif
+
+/**
+ * Prepares the backend, for the data file this creates an empty log.
+ * @return 0 on success, -1 on failure.
+ */
+int history_init(void) {
+#if USE_AESD_CHAR_DEVICE != 1
+    remove_log();
+    if (config.segmented) {
+        if (mkdir(OUT_FILE, 0755) == 0)
+            segments.dir_fd = open(OUT_FILE, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    } else { // the data files are created next to where OUT_FILE is
+        const char *path = OUT_FILE, *slash = strrchr(path, '/');
+        char dir[PATH_MAX];
+        if (slash)
+            snprintf(dir, sizeof(dir), "%.*s", slash == path ? 1 : (int)(slash - path), path);
+        segments.name = slash ? slash + 1 : path;
+        segments.dir_fd = open(slash ? dir : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    if (segments.dir_fd < 0) {
+        log_msg(LOG_ERR, "Failed to create %s: %s", OUT_FILE, strerror(errno));
+        return -1;
+    }
+    segments.slots = NULL;
+    segments.head = segments.first = segments.count = segments.capacity = 0;
+    segments.indexed_slots = 0;
+    segments.entries = segments.first_entry = 0;
+    segments.log_start = 0;
+    segments.indexed = segments.entry_start = 0;
+    pthread_mutex_init(&segments.lock, NULL);
+    pthread_mutex_init(&segments.index_lock, NULL);
+    append_log.reserved = 0;
+    append_log.committed = 0;
+    append_log.pending = NULL;
+    append_log.spare_ranges = NULL;
+    append_log.commit_waiters = 0;
+    pthread_mutex_init(&append_log.commit_lock, NULL);
+    pthread_cond_init(&append_log.committed_moved, NULL);
+    // an io_uring engine completes all its appends on one thread, which can't wait for an
+    // earlier range to be committed: every append they have in flight can be parked without
+    // malloc()
+    int in_flight = config.engine == ENGINE_URING ? config.max_inflight * config.shards : 0;
+    for (int i = 0; i < in_flight; i++) {
+        struct pending_range *range = malloc(sizeof(struct pending_range));
+        if (!range)
+            break;
+        range->next = append_log.spare_ranges;
+        append_log.spare_ranges = range;
+    }
+
+    memset(&cache, 0, sizeof(cache));
+    pthread_mutex_init(&cache.lock, NULL);
+    cache.max_chunks = config.cache_size / HISTORY_CHUNK_SIZE;
+    if (config.cache_size && !cache.max_chunks)
+        cache.max_chunks = 1;
+#else
+    map_device();
+#endif
+    return 0;
+}
+
+void history_cleanup(void) {
+#if USE_AESD_CHAR_DEVICE != 1
+    for (size_t i = 0; i < cache.count; i++)
+        history_chunk_put(cache.chunks[i]);
+    free(cache.chunks);
+    pthread_mutex_destroy(&cache.lock);
+    while (spares.list) {
+        struct history_chunk *chunk = spares.list;
+        spares.list = chunk->next_spare;
+        free(chunk);
+    }
+    spares.count = 0;
+
+    struct pending_range *lists[] = {append_log.pending, append_log.spare_ranges};
+    for (int i = 0; i < 2; i++) {
+        while (lists[i]) {
+            struct pending_range *range = lists[i];
+            lists[i] = range->next;
+            free(range);
+        }
+    }
+    append_log.pending = append_log.spare_ranges = NULL;
+    pthread_mutex_destroy(&append_log.commit_lock);
+    pthread_cond_destroy(&append_log.committed_moved);
+
+    for (size_t i = 0; i < segments.count; i++) {
+        struct history_segment *segment = segments.slots[segments.head + i].segment;
+        if (!segment)
+            continue;
+        if (!config.segmented) // next to OUT_FILE, remove_log() won't find them
+            segment_unlink(segment->start);
+        history_segment_put(segment);
+    }
+    free(segments.slots);
+    segments.slots = NULL;
+    segments.count = segments.capacity = 0;
+    pthread_mutex_destroy(&segments.lock);
+    pthread_mutex_destroy(&segments.index_lock);
+    close(segments.dir_fd);
+    segments.dir_fd = -1;
+    remove_log();
+#else
+    if (device_map.header)
+        munmap((void *)device_map.header, device_map.len);
+    device_map.header = NULL;
+#endif
+}
+
+/**
+ * Opens the history for a connection.
+ * @return a descriptor to pass to the other history functions, -1 on failure.
+ */
+int history_open(void) {
+#if USE_AESD_CHAR_DEVICE == 1
+    int fd = open(OUT_FILE, O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+        log_msg(LOG_ERR, "Failed to open %s: %s", OUT_FILE, strerror(errno));
+    return fd;
+#else
+    return segments.dir_fd;
+#endif
+}
+
+void history_close(int fd) {
+#if USE_AESD_CHAR_DEVICE == 1
+    if (fd >= 0)
+        close(fd);
+#endif
+}
+
+#if USE_AESD_CHAR_DEVICE != 1
+void history_chunk_put(struct history_chunk *chunk) {
+    if (__atomic_sub_fetch(&chunk->refs, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+    pthread_mutex_lock(&spares.lock);
+    if (spares.count < SPARE_CHUNKS) {
+        chunk->next_spare = spares.list;
+        spares.list = chunk;
+        spares.count++;
+        chunk = NULL;
+    }
+    pthread_mutex_unlock(&spares.lock);
+    free(chunk);
+}
+
+static struct history_chunk *chunk_alloc(void) {
+    pthread_mutex_lock(&spares.lock);
+    struct history_chunk *chunk = spares.list;
+    if (chunk) {
+        spares.list = chunk->next_spare;
+        spares.count--;
+    }
+    pthread_mutex_unlock(&spares.lock);
+    return chunk ? chunk : malloc(sizeof(struct history_chunk));
+}
+
+/**
+ * Drops every cached chunk, used when the cache can't grow anymore. Must be called with the
+ * cache lock held.
+ */
+static void cache_disable(void) {
+    log_msg(LOG_WARNING, "Out of memory, disabling the history cache");
+    for (size_t i = 0; i < cache.count; i++)
+        history_chunk_put(cache.chunks[i]);
+    cache.count = 0;
+    cache.max_chunks = 0;
+}
+
+/**
+ * Copies the log range [@param off, @param off + @param len) held in @param buf into the cache,
+ * adding chunks as needed and dropping the oldest ones above the memory cap.
+ */
+static void cache_fill(off_t off, const char *buf, size_t len) {
+    struct history_chunk *targets[len / HISTORY_CHUNK_SIZE + 2];
+    size_t ntargets = 0;
+    size_t first_needed = off / HISTORY_CHUNK_SIZE;
+    size_t last_needed = (off + len - 1) / HISTORY_CHUNK_SIZE;
+
+    if (len == 0)
+        return;
+    pthread_mutex_lock(&cache.lock);
+    while (cache.max_chunks && cache.first + cache.count <= last_needed) {
+        if (cache.count == cache.capacity) {
+            size_t capacity = cache.capacity ? 2 * cache.capacity : 64;
+            struct history_chunk **chunks =
+                realloc(cache.chunks, capacity * sizeof(struct history_chunk *));
+            if (!chunks) {
+                cache_disable();
+                break;
+            }
+            cache.chunks = chunks;
+            cache.capacity = capacity;
+        }
+        struct history_chunk *chunk = chunk_alloc();
+        if (!chunk) {
+            cache_disable();
+            break;
+        }
+        chunk->start = (off_t)(cache.first + cache.count) * HISTORY_CHUNK_SIZE;
+        chunk->refs = 1;
+        cache.chunks[cache.count++] = chunk;
+
+        // drop the oldest chunks, readers still sending them keep their own reference
+        while (cache.count > cache.max_chunks) {
+            history_chunk_put(cache.chunks[0]);
+            memmove(cache.chunks, cache.chunks + 1,
+                    (cache.count - 1) * sizeof(struct history_chunk *));
+            cache.count--;
+            cache.first++;
+        }
+    }
+    // chunks older than the cache were dropped already, that part is only in the file
+    for (size_t n = first_needed; n <= last_needed; n++) {
+        if (n >= cache.first && n < cache.first + cache.count) {
+            targets[ntargets] = cache.chunks[n - cache.first];
+            __atomic_add_fetch(&targets[ntargets]->refs, 1, __ATOMIC_RELAXED);
+            ntargets++;
+        }
+    }
+    pthread_mutex_unlock(&cache.lock);
+
+    // the ranges of concurrent writers never overlap, the copy happens without the lock
+    for (size_t i = 0; i < ntargets; i++) {
+        struct history_chunk *chunk = targets[i];
+        off_t from = off > chunk->start ? off : chunk->start;
+        off_t to = off + (off_t)len;
+        if (to > chunk->start + HISTORY_CHUNK_SIZE)
+            to = chunk->start + HISTORY_CHUNK_SIZE;
+        memcpy(chunk->data + (from - chunk->start), buf + (from - off), to - from);
+        history_chunk_put(chunk);
+    }
+}
+
+/**
+ * Looks up the cached chunk holding the log offset @param off.
+ * @return the chunk with a reference the caller must drop with history_chunk_put(), or NULL if
+ * that part of the log is not cached.
+ */
+struct history_chunk *history_cache_get(off_t off) {
+    struct history_chunk *chunk = NULL;
+    size_t n = off / HISTORY_CHUNK_SIZE;
+    pthread_mutex_lock(&cache.lock);
+    if (n >= cache.first && n < cache.first + cache.count) {
+        chunk = cache.chunks[n - cache.first];
+        __atomic_add_fetch(&chunk->refs, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&cache.lock);
+    return chunk;
+}
+
+/**
+ * @return the first log offset held by the cache, everything before it has to be read from the
+ * file. -1 when the cache holds nothing.
+ */
+off_t history_cache_start(void) {
+    off_t start = -1;
+    pthread_mutex_lock(&cache.lock);
+    if (cache.count)
+        start = cache.chunks[0]->start;
+    pthread_mutex_unlock(&cache.lock);
+    return start;
+}
+
+/**
+ * @return the address of the log offset @param off in @param chunk, @param len is set to the
+ * number of bytes from there to the end of the chunk.
+ */
+const char *history_chunk_data(struct history_chunk *chunk, off_t off, size_t *len) {
+    *len = chunk->start + HISTORY_CHUNK_SIZE - off;
+    return chunk->data + (off - chunk->start);
+}
+
+static void segment_free(struct history_segment *segment) {
+    if (segment->index != MAP_FAILED)
+        munmap(segment->index, segment->index_capacity * sizeof(uint64_t));
+    if (segment->data != MAP_FAILED)
+        munmap((void *)segment->data, config.segment_size);
+    if (segment->index_fd >= 0)
+        close(segment->index_fd);
+    if (segment->fd >= 0)
+        close(segment->fd);
+    free(segment);
+}
+
+/**
+ * Creates the data and index files of the segment number @param number, and maps them.
+ * @return the segment with the reference of the segment table, NULL on failure.
+ */
+static struct history_segment *segment_create(size_t number) {
+    struct history_segment *segment = calloc(1, sizeof(struct history_segment));
+    if (!segment)
+        return NULL;
+    segment->start = (off_t)number * config.segment_size;
+    segment->fd = segment->index_fd = -1;
+    segment->data = MAP_FAILED;
+    segment->index = MAP_FAILED;
+    segment->index_capacity = INDEX_MIN_ENTRIES;
+    segment->refs = 1;
+
+    char log_name[SEGMENT_NAME_SIZE], index_name[SEGMENT_NAME_SIZE];
+    segment_name(log_name, sizeof(log_name), segment->start, "log");
+    segment_name(index_name, sizeof(index_name), segment->start, "idx");
+    segment->fd = openat(segments.dir_fd, log_name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    // the whole range is mapped once and for all: segment files are sized up front, the single
+    // data file only grows as it is written, so that it holds nothing but the history
+    if (segment->fd >= 0 &&
+        (!config.segmented || ftruncate(segment->fd, config.segment_size) == 0))
+        segment->data = mmap(NULL, config.segment_size, PROT_READ, MAP_SHARED, segment->fd, 0);
+    if (segment->data != MAP_FAILED)
+        segment->index_fd = openat(segments.dir_fd, index_name,
+                                   O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    size_t index_size = segment->index_capacity * sizeof(uint64_t);
+    if (segment->index_fd >= 0 && ftruncate(segment->index_fd, index_size) == 0)
+        segment->index = mmap(NULL, index_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                              segment->index_fd, 0);
+    if (segment->index == MAP_FAILED) {
+        log_msg(LOG_ERR, "Failed to create the history segment %s: %s", log_name,
+                strerror(errno));
+        off_t start = segment->start;
+        segment_free(segment);
+        segment_unlink(start);
+        return NULL;
+    }
+    return segment;
+}
+
+/**
+ * @return the slot of the segment number @param number, adding slots up to it as needed. Must
+ * be called with the segments lock held. NULL if it can't be added (or was dropped).
+ */
+static struct segment_slot *segment_slot(size_t number) {
+    if (number < segments.first)
+        return NULL;
+    size_t n = number - segments.first;
+    if (segments.head + n >= segments.capacity && segments.head) {
+        // reclaim the slots of the dropped segments first, so dropping one stays O(1)
+        memmove(segments.slots, segments.slots + segments.head,
+                segments.count * sizeof(struct segment_slot));
+        segments.head = 0;
+    }
+    if (n >= segments.capacity) {
+        size_t capacity = segments.capacity ? 2 * segments.capacity : 16;
+        while (capacity <= n)
+            capacity *= 2;
+        struct segment_slot *slots = realloc(segments.slots, capacity * sizeof(*slots));
+        if (!slots)
+            return NULL;
+        segments.slots = slots;
+        segments.capacity = capacity;
+    }
+    struct segment_slot *slots = segments.slots + segments.head;
+    if (n >= segments.count) {
+        memset(slots + segments.count, 0, (n + 1 - segments.count) * sizeof(struct segment_slot));
+        segments.count = n + 1;
+    }
+    return &slots[n];
+}
+
+/**
+ * Looks up the segment holding the log offset @param off.
+ * @param create: set by writers, creates the segment when it doesn't exist yet.
+ * @return the segment with a reference the caller must drop with history_segment_put(), NULL
+ * if that part of the log has no segment.
+ */
+struct history_segment *history_segment_get(off_t off, int create) {
+    struct history_segment *segment = NULL;
+    size_t number = off / config.segment_size;
+    pthread_mutex_lock(&segments.lock);
+    struct segment_slot *slot = NULL;
+    if (create)
+        slot = segment_slot(number);
+    else if (number >= segments.first && number - segments.first < segments.count)
+        slot = &segments.slots[segments.head + number - segments.first];
+    if (slot && !slot->segment && create)
+        slot->segment = segment_create(number);
+    if (slot && slot->segment) {
+        segment = slot->segment;
+        __atomic_add_fetch(&segment->refs, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&segments.lock);
+    return segment;
+}
+
+void history_segment_put(struct history_segment *segment) {
+    if (__atomic_sub_fetch(&segment->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        segment_free(segment);
+}
+
+/**
+ * @return the mapped address of the log offset @param off in @param segment, @param len is set
+ * to the number of bytes from there to the end of the segment.
+ */
+const char *history_segment_data(struct history_segment *segment, off_t off, size_t *len) {
+    *len = segment->start + config.segment_size - off;
+    return segment->data + (off - segment->start);
+}
+
+/**
+ * @return the data file descriptor of @param segment, @param file_off is set to the position of
+ * the log offset @param off in it and @param len to the number of bytes from there to the end of
+ * the segment.
+ */
+int history_segment_fd(struct history_segment *segment, off_t off, off_t *file_off, size_t *len) {
+    *file_off = off - segment->start;
+    *len = config.segment_size - *file_off;
+    return segment->fd;
+}
+
+/**
+ * Doubles the capacity of the index of @param segment. Must be called with the segments lock
+ * held, as the mapping may move.
+ * @return 0 on success, -1 on failure.
+ */
+static int index_grow(struct history_segment *segment) {
+    size_t size = segment->index_capacity * sizeof(uint64_t);
+    if (ftruncate(segment->index_fd, 2 * size))
+        return -1;
+    void *index = mremap(segment->index, size, 2 * size, MREMAP_MAYMOVE);
+    if (index == MAP_FAILED)
+        return -1;
+    segment->index = index;
+    segment->index_capacity *= 2;
+    return 0;
+}
+
+/**
+ * Adds the entries ending in the @param len bytes of @param data, which hold the log range
+ * starting at @param off, to the index of @param segment after its first @param entries ones.
+ * @param entries: incremented for every entry added.
+ * @return 0 on success, -1 if the index can't grow.
+ */
+static int index_data(struct history_segment *segment, size_t *entries, const char *data,
+                      off_t off, size_t len) {
+    const char *pos = data, *end = data + len, *nl;
+    while ((nl = memchr(pos, '\n', end - pos)) != NULL) {
+        if (*entries == segment->index_capacity) {
+            pthread_mutex_lock(&segments.lock);
+            int failed = index_grow(segment);
+            pthread_mutex_unlock(&segments.lock);
+            if (failed)
+                return -1;
+        }
+        pos = nl + 1;
+        segment->index[(*entries)++] = off + (pos - data);
+    }
+    return 0;
+}
+
+/**
+ * Adds the entries ending in the committed range [segments.indexed, @param end) to the index.
+ * Must be called with the index lock held.
+ * @return 0 on success, -1 if the index can't grow (the rest is indexed by the next call).
+ */
+static int index_range(off_t end) {
+    while (segments.indexed < end) {
+        off_t from = segments.indexed;
+        size_t number = from / config.segment_size;
+        off_t to = (off_t)(number + 1) * config.segment_size;
+        to = to < end ? to : end;
+
+        pthread_mutex_lock(&segments.lock);
+        struct segment_slot *slot = segment_slot(number);
+        if (slot && number - segments.first == segments.indexed_slots) { // entering it
+            slot->first_entry = segments.entries;
+            slot->first_start = segments.entry_start;
+            segments.indexed_slots++;
+        }
+        pthread_mutex_unlock(&segments.lock);
+        if (!slot)
+            return -1;
+        struct history_segment *segment = history_segment_get(from, 0);
+        if (!segment) { // a write to it failed (or it is dropped already), a hole in the log
+            __atomic_store_n(&segments.indexed, to, __ATOMIC_SEQ_CST);
+            continue;
+        }
+
+        // only the indexer writes entries past the published ones, readers never see them
+        size_t entries = segment->entries;
+        off_t pos = from;
+        int failed = 0;
+        while (pos < to && !failed) {
+            // scan the cached copy of the range when there is one: it was just written and is
+            // still in the CPU cache, while reading the mapping would fault its pages in
+            struct history_chunk *chunk = history_cache_get(pos);
+            size_t len;
+            const char *data = chunk ? history_chunk_data(chunk, pos, &len)
+                                     : history_segment_data(segment, pos, &len);
+            len = len < (size_t)(to - pos) ? len : (size_t)(to - pos);
+            failed = index_data(segment, &entries, data, pos, len);
+            if (chunk)
+                history_chunk_put(chunk);
+            pos += len;
+        }
+
+        __atomic_store_n(&segment->last_write, metrics_now(), __ATOMIC_RELAXED);
+        size_t added = entries - segment->entries;
+        pthread_mutex_lock(&segments.lock);
+        segments.entries += added;
+        segment->entries = entries;
+        pthread_mutex_unlock(&segments.lock);
+        if (added)
+            segments.entry_start = segment->index[entries - 1];
+        history_segment_put(segment);
+        if (failed) {
+            log_msg(LOG_ERR, "Failed to grow the history index: %s", strerror(errno));
+            // resume after the last indexed entry
+            __atomic_store_n(&segments.indexed, added ? segments.entry_start : from,
+                             __ATOMIC_SEQ_CST);
+            return -1;
+        }
+        __atomic_store_n(&segments.indexed, to, __ATOMIC_SEQ_CST);
+    }
+    return 0;
+}
+
+/**
+ * Indexes the newly committed data, unless another thread is doing it already: that one checks
+ * the committed length again after releasing the index lock.
+ */
+static void index_committed(void) {
+    for (;;) {
+        off_t committed = __atomic_load_n(&append_log.committed, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&segments.indexed, __ATOMIC_SEQ_CST) >= committed)
+            return;
+        if (pthread_mutex_trylock(&segments.index_lock))
+            return;
+        int failed = index_range(committed);
+        pthread_mutex_unlock(&segments.index_lock);
+        if (failed)
+            return;
+    }
+}
+
+/**
+ * Where the history starts once the oldest segment is dropped: at the next segment, or past the
+ * packet straddling both segments since its start is gone. Must be called with the segments lock
+ * held, with at least two indexed slots.
+ * @param start: set to the log offset of the new start.
+ * @return the number of the first entry of the new history.
+ */
+static uint64_t next_log_start(off_t *start) {
+    struct segment_slot *next = &segments.slots[segments.head + 1];
+    *start = (off_t)(segments.first + 1) * config.segment_size;
+    if (next->first_start < *start && next->segment && next->segment->entries) {
+        *start = next->segment->index[0];
+        return next->first_entry + 1;
+    }
+    return next->first_entry;
+}
+
+/**
+ * @return 1 if the oldest segment is out of the retention limits: the history left once it is
+ * dropped still holds config.retain_bytes bytes or config.retain_packets packets, or nothing was
+ * written to it for config.retain_age. Only segments indexed up to their end are candidates.
+ * Must be called with the segments lock held.
+ */
+static int oldest_expired(uint64_t now) {
+    if (segments.indexed_slots < 2)
+        return 0;
+    struct history_segment *oldest = segments.slots[segments.head].segment;
+    off_t start;
+    uint64_t first_entry = next_log_start(&start);
+    off_t committed = __atomic_load_n(&append_log.committed, __ATOMIC_ACQUIRE);
+    if (config.retain_bytes && (uint64_t)(committed - start) >= config.retain_bytes)
+        return 1;
+    if (config.retain_packets && segments.entries - first_entry >= config.retain_packets)
+        return 1;
+    if (config.retain_age &&
+        (!oldest || now - __atomic_load_n(&oldest->last_write, __ATOMIC_RELAXED) >=
+                        (uint64_t)config.retain_age))
+        return 1;
+    return 0;
+}
+
+/**
+ * Drops the oldest segments as long as they are out of the retention limits. Dropping one is
+ * O(1): its slot is skipped, its files are unlinked and the replays still using it keep their
+ * reference until they are done.
+ */
+static void enforce_retention(void) {
+    if (!config.retain_bytes && !config.retain_packets && !config.retain_age)
+        return;
+    uint64_t now = metrics_now();
+    for (;;) {
+        pthread_mutex_lock(&segments.lock);
+        if (!oldest_expired(now)) {
+            pthread_mutex_unlock(&segments.lock);
+            return;
+        }
+        struct history_segment *segment = segments.slots[segments.head].segment;
+        off_t dropped = (off_t)segments.first * config.segment_size;
+        off_t start;
+        segments.first_entry = next_log_start(&start);
+        __atomic_store_n(&segments.log_start, start, __ATOMIC_RELEASE);
+        segments.head++;
+        segments.first++;
+        segments.count--;
+        segments.indexed_slots--;
+        pthread_mutex_unlock(&segments.lock);
+
+        segment_unlink(dropped);
+        if (segment)
+            history_segment_put(segment);
+        metrics_add(M_SEGMENTS_DROPPED, 1);
+        log_msg(LOG_DEBUG, "Dropped the history segment at %lld", (long long)dropped);
+    }
+}
+
+/**
+ * Locks @param lock, timing the wait (H_HISTORY_WAIT_US) when it is contended.
+ */
+static void lock_history(pthread_mutex_t *lock) {
+    if (pthread_mutex_trylock(lock) == 0)
+        return;
+    uint64_t start = metrics_now();
+    pthread_mutex_lock(lock);
+    metrics_record(H_HISTORY_WAIT_US, (metrics_now() - start) / 1000);
+}
+
+/**
+ * Reserves @param len bytes at the end of the data file log.
+ * @return the offset to write them at, the range must then be committed with history_commit().
+ */
+off_t history_reserve(size_t len) {
+    return __atomic_fetch_add(&append_log.reserved, (off_t)len, __ATOMIC_RELAXED);
+}
+
+/**
+ * Makes the written range [@param off, @param off + @param len) (and any range waiting for it)
+ * visible to readers once every earlier reservation is written too. A range written before an
+ * earlier one is parked in the pending list, or if that can't be allocated, its writer waits for
+ * the earlier ranges and commits it itself.
+ */
+static void commit_range(off_t off, size_t len) {
+    lock_history(&append_log.commit_lock);
+    off_t committed = append_log.committed;
+    if (off != committed) { // an earlier range is still being written, park this one
+        struct pending_range *range = append_log.spare_ranges;
+        if (range)
+            append_log.spare_ranges = range->next;
+        else
+            range = malloc(sizeof(struct pending_range));
+        if (range) {
+            struct pending_range **pos = &append_log.pending;
+            while (*pos && (*pos)->off < off)
+                pos = &(*pos)->next;
+            range->off = off;
+            range->len = len;
+            range->next = *pos;
+            *pos = range;
+            pthread_mutex_unlock(&append_log.commit_lock);
+            return;
+        }
+        log_msg(LOG_WARNING, "Out of memory, committing at %lld synchronously", (long long)off);
+        append_log.commit_waiters++;
+        while (append_log.committed != off)
+            pthread_cond_wait(&append_log.committed_moved, &append_log.commit_lock);
+        append_log.commit_waiters--;
+        committed = off;
+    }
+
+    committed += len;
+    while (append_log.pending && append_log.pending->off == committed) {
+        struct pending_range *range = append_log.pending;
+        committed += range->len;
+        append_log.pending = range->next;
+        range->next = append_log.spare_ranges;
+        append_log.spare_ranges = range;
+    }
+    __atomic_store_n(&append_log.committed, committed, __ATOMIC_SEQ_CST);
+    if (append_log.commit_waiters)
+        pthread_cond_broadcast(&append_log.committed_moved);
+    pthread_mutex_unlock(&append_log.commit_lock);
+    index_committed();
+    enforce_retention();
+}
+
+/**
+ * Marks the reserved range [@param off, @param off + @param len) as written with the contents
+ * of @param buf, see commit_range(). Every reservation must be committed, even if its write
+ * failed: the range is then a hole in the log, while an uncommitted one would block every later
+ * writer.
+ */
+void history_commit(off_t off, const void *buf, size_t len) {
+    cache_fill(off, buf, len);
+    commit_range(off, len);
+}
+#else
+off_t history_reserve(size_t len) { return -1; }
+void history_commit(off_t off, const void *buf, size_t len) {}
+struct history_chunk *history_cache_get(off_t off) { return NULL; }
+off_t history_cache_start(void) { return -1; }
+const char *history_chunk_data(struct history_chunk *chunk, off_t off, size_t *len) { return NULL; }
+void history_chunk_put(struct history_chunk *chunk) {}
+/**
+ * @return the device mapping if it still holds the stream offset @param off, NULL otherwise
+ * (overwritten by newer packets, or the end of the history).
+ */
+struct history_segment *history_segment_get(off_t off, int create) {
+    uint64_t history, first, end;
+    if (!device_map.header)
+        return NULL;
+    map_window(&history, &first, &end);
+    return (uint64_t)off >= first && (uint64_t)off < end ? &device_map : NULL;
+}
+const char *history_segment_data(struct history_segment *segment, off_t off, size_t *len) {
+    uint64_t history, first, end;
+    map_window(&history, &first, &end);
+    size_t pos = off % segment->header->data_size;
+    size_t contiguous = segment->header->data_size - pos; // up to the end of the data ring
+    *len = end - off < contiguous ? end - off : contiguous;
+    return segment->data + pos;
+}
+int history_segment_fd(struct history_segment *segment, off_t off, off_t *file_off, size_t *len) {
+    return -1;
+}
+void history_segment_put(struct history_segment *segment) {}
+#endif
+
+/**
+ * An append waiting in the group commit queue.
+ */
+struct group_write {
+    int fd;
+    const void *buf;
+    size_t len;
+    ssize_t result;
+    int done;
+    struct group_write *next;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t done; // broadcast whenever a batch has been written
+    struct group_write *head, *tail; // queued appends, in arrival order
+    int busy; // a committer is writing a batch
+} group = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+/**
+ * Writes the @param count iovecs of @param iov to @param fd (at offset @param off, -1 for a
+ * plain writev() of the char device), resuming after short writes.
+ * @return the number of bytes written.
+ */
+static size_t write_iov(int fd, struct iovec *iov, int count, off_t off) {
+    size_t done = 0;
+    while (count > 0) {
+        ssize_t bytes = off >= 0 ? pwritev(fd, iov, count, off + done) : writev(fd, iov, count);
+        if (bytes < 0 && errno == EINTR)
+            continue;
+        if (bytes <= 0)
+            break;
+        done += bytes;
+        while (count > 0 && (size_t)bytes >= iov->iov_len) {
+            bytes -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + bytes;
+            iov->iov_len -= bytes;
+        }
+    }
+    return done;
+}
+
+#if USE_AESD_CHAR_DEVICE != 1
+/**
+ * Grows the single data file of @param segment to at least @param end bytes after a write up to
+ * there failed: the range is committed anyway, and reading it through the mapping must get
+ * zeroes rather than SIGBUS.
+ */
+static void extend_file(struct history_segment *segment, off_t end) {
+    char zero = 0;
+    struct stat st;
+    // the last byte belongs to the failed range, writing it can't clobber another writer
+    if (pwrite(segment->fd, &zero, 1, end - 1) == 1 || fstat(segment->fd, &st) ||
+        st.st_size >= end)
+        return;
+    // out of space even for that byte: the other writers are failing too, truncating is safe
+    if (ftruncate(segment->fd, end))
+        log_msg(LOG_ERR, "Failed to extend %s: %s", OUT_FILE, strerror(errno));
+}
+
+/**
+ * Writes the @param count iovecs of @param iov at the log offset @param off, cutting them where
+ * the range crosses into the next segment. The iovecs are consumed.
+ * @return the number of bytes written.
+ */
+static size_t write_log(struct iovec *iov, int count, off_t off) {
+    size_t done = 0;
+    while (count > 0) {
+        if (iov->iov_len == 0) { // don't create a segment for nothing
+            iov++;
+            count--;
+            continue;
+        }
+        off_t pos = off + (off_t)done;
+        struct history_segment *segment = history_segment_get(pos, 1);
+        if (!segment)
+            break;
+        size_t room = segment->start + config.segment_size - pos;
+        size_t len = 0;
+        int n = 0;
+        while (n < count && len < room)
+            len += iov[n++].iov_len;
+        // the end of the last iovec may belong to the next segment
+        size_t over = len > room ? len - room : 0;
+        struct iovec last = iov[n - 1];
+        iov[n - 1].iov_len -= over;
+        size_t written = write_iov(segment->fd, iov, n, pos - segment->start);
+        if (written != len - over && !config.segmented)
+            extend_file(segment, pos - segment->start + (off_t)(len - over));
+        history_segment_put(segment);
+        done += written;
+        if (written != len - over)
+            break;
+        if (over) {
+            iov[n - 1].iov_base = (char *)last.iov_base + last.iov_len - over;
+            iov[n - 1].iov_len = over;
+            n--;
+        }
+        iov += n;
+        count -= n;
+    }
+    return done;
+}
+
+/**
+ * fdatasync()s the segments holding the log range [@param off, @param off + @param len).
+ * @return 0 on success, -1 on failure.
+ */
+static int sync_log(off_t off, size_t len) {
+    for (off_t pos = off - off % config.segment_size; pos < off + (off_t)len;
+         pos += config.segment_size) {
+        struct history_segment *segment = history_segment_get(pos, 0);
+        if (!segment)
+            return -1;
+        int failed = fdatasync(segment->fd);
+        history_segment_put(segment);
+        if (failed)
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * Writes the @param len bytes of @param buf at the reserved log offset @param off, over as many
+ * segments as the range spans, and makes them durable with config.sync_writes. The range still
+ * has to be committed.
+ * @return the number of bytes written, -1 on failure.
+ */
+ssize_t history_write(off_t off, const void *buf, size_t len) {
+    struct iovec iov = {.iov_base = (void *)buf, .iov_len = len};
+    size_t done = write_log(&iov, 1, off);
+    if (done == len && config.sync_writes && sync_log(off, len))
+        done = 0;
+    return done == len ? (ssize_t)len : -1;
+}
+#else
+ssize_t history_write(off_t off, const void *buf, size_t len) {
+    errno = EINVAL;
+    return -1;
+}
+#endif
+
+/**
+ * Appends the @param count queued writes starting at @param batch with a single writev() (and
+ * a single fdatasync() with config.sync_writes), then stores the result of each of them.
+ * With the char device, each write goes through the file of its own connection instead: the
+ * driver keeps the unterminated start of a packet per open file, so a write without a new line
+ * must only be joined by the rest of its packet. Consecutive writes of the same connection
+ * share a writev().
+ */
+static void write_batch(struct group_write *batch, int count) {
+    struct iovec iov[IOV_MAX];
+    size_t total = 0;
+    struct group_write *w = batch;
+    for (int i = 0; i < count; i++, w = w->next) {
+        iov[i].iov_base = (void *)w->buf;
+        iov[i].iov_len = w->len;
+        total += w->len;
+    }
+
+#if USE_AESD_CHAR_DEVICE == 1
+    w = batch;
+    for (int first = 0; first < count;) {
+        struct group_write *run = w;
+        int n = 0;
+        while (first + n < count && w->fd == run->fd) {
+            w = w->next;
+            n++;
+        }
+        // the driver gets one write() per iovec, so every packet still becomes its own entry
+        size_t done = write_iov(run->fd, iov + first, n, -1), end = 0;
+        for (; run != w; run = run->next) {
+            end += run->len;
+            run->result = end <= done ? (ssize_t)run->len : -1;
+        }
+        first += n;
+    }
+#else
+    off_t off = history_reserve(total);
+    size_t done = write_log(iov, count, off);
+    if (done == total && config.sync_writes && sync_log(off, total))
+        done = 0;
+
+    size_t end = 0;
+    w = batch;
+    for (int i = 0; i < count; i++, w = w->next) {
+        history_commit(off + end, w->buf, w->len);
+        end += w->len;
+        w->result = end <= done ? (ssize_t)w->len : -1;
+    }
+#endif
+}
+
+/**
+ * Group commit: queues the append and waits until it has been written. The oldest queued
+ * writer becomes the committer whenever no batch is being written: it takes every append
+ * queued at that time and writes them at once, so concurrent writers share their syscalls.
+ */
+static ssize_t group_append(int fd, const void *buf, size_t len) {
+    struct group_write self = {.fd = fd, .buf = buf, .len = len};
+    uint64_t start = metrics_now();
+
+    pthread_mutex_lock(&group.lock);
+    if (group.tail)
+        group.tail->next = &self;
+    else
+        group.head = &self;
+    group.tail = &self;
+    while (!self.done && (group.busy || group.head != &self))
+        pthread_cond_wait(&group.done, &group.lock);
+    metrics_record(H_HISTORY_WAIT_US, (metrics_now() - start) / 1000);
+    if (self.done) { // written by another committer
+        pthread_mutex_unlock(&group.lock);
+        return self.result;
+    }
+
+    // take the batch out of the queue, later writers queue up for the next one meanwhile
+    struct group_write *batch = group.head, *last = batch;
+    int count = 1;
+    while (last->next && count < IOV_MAX) {
+        last = last->next;
+        count++;
+    }
+    group.head = last->next;
+    if (!group.head)
+        group.tail = NULL;
+    last->next = NULL;
+    group.busy = 1;
+    pthread_mutex_unlock(&group.lock);
+
+    write_batch(batch, count);
+
+    pthread_mutex_lock(&group.lock);
+    for (struct group_write *w = batch; w; w = w->next)
+        w->done = 1;
+    group.busy = 0;
+    pthread_cond_broadcast(&group.done);
+    pthread_mutex_unlock(&group.lock);
+    return self.result;
+}
+
+/**
+ * Appends the @param len bytes of @param buf to the history opened as @param fd, through the
+ * group commit queue when config.group_commit is set.
+ * @return the number of bytes written, -1 on failure.
+ */
+ssize_t history_append(int fd, const void *buf, size_t len) {
+    if (config.group_commit)
+        return group_append(fd, buf, len);
+#if USE_AESD_CHAR_DEVICE == 1
+    return write(fd, buf, len);
+#else
+    off_t off = history_reserve(len);
+    ssize_t written = history_write(off, buf, len);
+    history_commit(off, buf, len);
+    return written;
+#endif
+}
+
+/**
+ * Appends the @param count records of @param iov to the history opened as @param fd, as one
+ * contiguous range of the data file (one write() per record for the char device, which closes
+ * an entry at each new line). The batch already shares its syscalls, so it doesn't go through
+ * the group commit queue.
+ * @param off: set to the history offset of the first record, -1 with the char device.
+ * @return the number of bytes written, -1 on failure.
+ */
+ssize_t history_appendv(int fd, const struct iovec *iov, int count, off_t *off) {
+    size_t total = 0;
+    for (int i = 0; i < count; i++)
+        total += iov[i].iov_len;
+#if USE_AESD_CHAR_DEVICE == 1
+    *off = -1;
+#else
+    *off = history_reserve(total);
+#endif
+
+    size_t done = 0;
+    struct iovec batch[IOV_MAX];
+    for (int first = 0; first < count; first += IOV_MAX) {
+        int n = count - first < IOV_MAX ? count - first : IOV_MAX;
+        size_t len = 0;
+        for (int i = 0; i < n; i++)
+            len += iov[first + i].iov_len;
+        // write_iov() consumes the iovecs it is given
+        memcpy(batch, iov + first, n * sizeof(struct iovec));
+#if USE_AESD_CHAR_DEVICE == 1
+        size_t written = write_iov(fd, batch, n, -1);
+#else
+        size_t written = write_log(batch, n, *off + (off_t)done);
+#endif
+        done += written;
+        if (written != len)
+            break;
+    }
+#if USE_AESD_CHAR_DEVICE != 1
+    if (done == total && config.sync_writes && sync_log(*off, total))
+        done = 0;
+    // the whole batch is committed at once
+    size_t end = 0;
+    for (int i = 0; i < count; i++) {
+        cache_fill(*off + end, iov[i].iov_base, iov[i].iov_len);
+        end += iov[i].iov_len;
+    }
+    commit_range(*off, total);
+#endif
+    return done == total ? (ssize_t)total : -1;
+}
+
+/**
+ * Describes what a replay of the history opened as @param fd has to send.
+ * @param need_len: set if the caller needs to know the size of the replay up front.
+ * @param start: history offset the replay starts at (see history_seekto()), -1 for the whole
+ * history. A requested start is clamped to the end of the history, the window then ends at
+ * *start + *len. Both backends send the same window: the file position of the char device
+ * left by a previous replay doesn't matter.
+ * @param off: set to the offset to start reading at, -1 to read from the file position (the
+ * char device), or its stream offset in the device mapping (history_segment_get()).
+ * @param len: set to the number of bytes to replay, SIZE_MAX to read until end of file.
+ * @return 0 on success, -1 on failure.
+ */
+int history_replay_window(int fd, int need_len, off_t *start, off_t *off, size_t *len) {
+#if USE_AESD_CHAR_DEVICE == 1
+    off_t pos = *start >= 0 ? *start : 0;
+    if (device_map.header) { // the stream offsets of the window in the mapping
+        uint64_t history, first, end;
+        map_window(&history, &first, &end);
+        uint64_t stream = history + pos < end ? history + pos : end;
+        if (stream >= first) { // unless the mapping lost its start
+            if (*start >= 0)
+                *start = stream - history;
+            *off = stream;
+            *len = end - stream;
+            return 0;
+        }
+    }
+    *off = -1;
+    *len = SIZE_MAX;
+    if (need_len || *start >= 0) {
+        off_t end = lseek(fd, 0, SEEK_END);
+        if (end < 0)
+            return -1;
+        pos = pos < end ? pos : end;
+        if (*start >= 0)
+            *start = pos;
+        *len = end - pos;
+    }
+    // the reads go on from the file position
+    if (lseek(fd, pos, SEEK_SET) < 0)
+        return -1;
+#else
+    // everything committed and retained so far, the snapshot stays valid while writers go on
+    // appending. A replay falling behind the retained window as segments are dropped is cut
+    // short.
+    enforce_retention();
+    off_t end = __atomic_load_n(&append_log.committed, __ATOMIC_ACQUIRE);
+    off_t begin = __atomic_load_n(&segments.log_start, __ATOMIC_ACQUIRE);
+    *off = begin;
+    if (*start >= 0) {
+        *start = *start < end ? *start : end;
+        *start = *start > begin ? *start : begin;
+        *off = *start;
+    }
+    *len = end - *off;
+#endif
+    return 0;
+}
+
+/**
+ * Moves the replay position of the history opened as @param fd to the byte
+ * @param seekto->write_cmd_offset of the entry (packet) number @param seekto->write_cmd, counted
+ * from the oldest one.
+ * @param pos: set to the history offset to start the next replay at (for the char device, the
+ * file position the driver moved to).
+ * @return 0 on success, -1 on failure (EINVAL: no such entry or offset).
+ */
+int history_seekto(int fd, const struct aesd_seekto *seekto, off_t *pos) {
+#if USE_AESD_CHAR_DEVICE == 1
+    if (ioctl(fd, AESDCHAR_IOCSEEKTO, seekto))
+        return -1;
+    *pos = lseek(fd, 0, SEEK_CUR);
+    return *pos < 0 ? -1 : 0;
+#else
+    // every packet committed so far counts, even if its writer hasn't indexed it yet
+    pthread_mutex_lock(&segments.index_lock);
+    index_range(__atomic_load_n(&append_log.committed, __ATOMIC_SEQ_CST));
+    pthread_mutex_unlock(&segments.index_lock);
+
+    int ret = -1;
+    pthread_mutex_lock(&segments.lock);
+    uint64_t cmd = segments.first_entry + seekto->write_cmd; // counted from the oldest retained
+    if (cmd < segments.entries) {
+        // the entry is in the last segment whose first entry is not after it
+        struct segment_slot *slots = segments.slots + segments.head;
+        size_t lo = 0, hi = segments.indexed_slots;
+        while (hi - lo > 1) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (slots[mid].first_entry <= cmd)
+                lo = mid;
+            else
+                hi = mid;
+        }
+        struct segment_slot *slot = &slots[lo];
+        size_t i = cmd - slot->first_entry;
+        off_t start = i ? (off_t)slot->segment->index[i - 1] : slot->first_start;
+        off_t end = slot->segment->index[i];
+        // the oldest entry may have started in a dropped segment
+        start = start > segments.log_start ? start : segments.log_start;
+        if (seekto->write_cmd_offset < end - start) {
+            *pos = start + seekto->write_cmd_offset;
+            ret = 0;
+        }
+    }
+    pthread_mutex_unlock(&segments.lock);
+    if (ret)
+        errno = EINVAL;
+    return ret;
+#endif
+}
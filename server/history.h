@@ -0,0 +1,49 @@
+/*
+ * history.h
+ *
+ * Access to the history of received packets stored in OUT_FILE.
+ */
+
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <stddef.h>
+
+#define HISTORY_CHUNK_SIZE (64 * 1024) // size of the chunks of the in-memory history cache
+
+#define HISTORY_SEGMENT_SIZE ((off_t)64 << 20) // default log bytes per segment file (-G)
+#define HISTORY_SEGMENT_MIN 4096              // smallest segment size accepted
+// log bytes mapped from the single data file (no segments), any more go to OUT_FILE.<offset>
+#define HISTORY_FILE_SIZE (sizeof(void *) > 4 ? (off_t)1 << 40 : (off_t)1 << 30)
+
+struct aesd_seekto;
+struct history_chunk;
+struct history_segment;
+
+int history_init(void);
+void history_cleanup(void);
+
+int history_open(void);
+void history_close(int fd);
+
+off_t history_reserve(size_t len);
+void history_commit(off_t off, const void *buf, size_t len);
+ssize_t history_append(int fd, const void *buf, size_t len);
+ssize_t history_appendv(int fd, const struct iovec *iov, int count, off_t *off);
+int history_replay_window(int fd, int need_len, off_t *start, off_t *off, size_t *len);
+int history_seekto(int fd, const struct aesd_seekto *seekto, off_t *pos);
+ssize_t history_write(off_t off, const void *buf, size_t len);
+
+struct history_chunk *history_cache_get(off_t off);
+off_t history_cache_start(void);
+const char *history_chunk_data(struct history_chunk *chunk, off_t off, size_t *len);
+void history_chunk_put(struct history_chunk *chunk);
+
+struct history_segment *history_segment_get(off_t off, int create);
+const char *history_segment_data(struct history_segment *segment, off_t off, size_t *len);
+int history_segment_fd(struct history_segment *segment, off_t off, off_t *file_off, size_t *len);
+void history_segment_put(struct history_segment *segment);
+
+#endif /* HISTORY_H */
@@ -0,0 +1,212 @@
+/**
+ * @file log.c
+ * @brief Asynchronous logging for aesdsocket
+ *
+ * Every thread that logs gets its own single-producer / single-consumer ring of preformatted
+ * messages: the thread formats the message into the next free slot and publishes it with a
+ * release store, without any lock or syscall. A background thread drains the rings into syslog,
+ * without holding the lock of the ring list, and sleeps on an eventfd when they are all empty:
+ * the first message queued while it sleeps wakes it up, which is the only syscall of log_write().
+ * A full ring, or a thread going over LOG_RATE_LIMIT messages per second, drops the message;
+ * the log thread reports how many were dropped. The ring of an exiting thread is released by
+ * the log thread once it has been drained.
+ *
+ * Before log_init() (and after log_shutdown()) messages go straight to syslog.
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+#include "log.h"
+
+#define LOG_RING_SLOTS 128 // messages queued per thread
+#define LOG_MSG_SIZE 240   // longer messages are truncated
+
+struct log_slot {
+    int level;
+    char msg[LOG_MSG_SIZE];
+};
+
+struct log_ring {
+    unsigned head;    // next slot to fill, written by the owner thread only
+    unsigned tail;    // next slot to log, written by the log thread only
+    unsigned dropped; // messages dropped since the last report
+    int orphaned;     // the owner thread has exited
+    time_t second;    // rate limiting window, owner thread only
+    int in_second;    // messages logged in that window
+    struct log_ring *next;
+    struct log_slot slots[LOG_RING_SLOTS];
+};
+
+static struct {
+    pthread_mutex_t lock; // protects the head of the list of rings
+    struct log_ring *rings;
+    pthread_key_t key;    // orphans the ring of an exiting thread
+    pthread_t thread;
+    int running;
+    int idle;    // the log thread found every ring empty and waits on wake_fd
+    int wake_fd; // eventfd waking up the log thread
+} logger = {.lock = PTHREAD_MUTEX_INITIALIZER, .wake_fd = -1};
+
+static __thread struct log_ring *thread_ring;
+
+static void ring_orphan(void *arg) {
+    __atomic_store_n(&((struct log_ring *)arg)->orphaned, 1, __ATOMIC_RELEASE);
+}
+
+static struct log_ring *ring_register(void) {
+    struct log_ring *ring = calloc(1, sizeof(struct log_ring));
+    if (!ring)
+        return NULL;
+    pthread_mutex_lock(&logger.lock);
+    ring->next = logger.rings;
+    logger.rings = ring;
+    pthread_mutex_unlock(&logger.lock);
+    pthread_setspecific(logger.key, ring);
+    thread_ring = ring;
+    return ring;
+}
+
+void log_write(int level, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    struct log_ring *ring = thread_ring;
+    if (!__atomic_load_n(&logger.running, __ATOMIC_ACQUIRE) ||
+        (!ring && !(ring = ring_register()))) {
+        vsyslog(level, fmt, ap);
+        va_end(ap);
+        return;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    if (now.tv_sec != ring->second) {
+        ring->second = now.tv_sec;
+        ring->in_second = 0;
+    }
+    unsigned head = ring->head;
+    if (++ring->in_second > LOG_RATE_LIMIT ||
+        head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= LOG_RING_SLOTS) {
+        __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+        va_end(ap);
+        return;
+    }
+    struct log_slot *slot = &ring->slots[head % LOG_RING_SLOTS];
+    slot->level = level;
+    vsnprintf(slot->msg, sizeof(slot->msg), fmt, ap);
+    va_end(ap);
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+    // pairs with the fence of log_main(): either it sees the message, or this sees it idle
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&logger.idle, __ATOMIC_RELAXED) &&
+        __atomic_exchange_n(&logger.idle, 0, __ATOMIC_ACQ_REL))
+        eventfd_write(logger.wake_fd, 1);
+}
+
+/**
+ * Hands the queued messages of every ring to syslog and releases the drained rings of exited
+ * threads. Rings are only added at the head of the list and only removed here, so the list is
+ * walked without the lock, syslog() never delays a thread registering its ring.
+ * @return the number of messages logged.
+ */
+static int drain_rings(void) {
+    int logged = 0;
+    pthread_mutex_lock(&logger.lock);
+    struct log_ring *ring = logger.rings, *prev = NULL;
+    pthread_mutex_unlock(&logger.lock);
+    while (ring) {
+        struct log_ring *next = ring->next;
+        int orphaned = __atomic_load_n(&ring->orphaned, __ATOMIC_ACQUIRE);
+        unsigned head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        for (unsigned tail = ring->tail; tail != head; tail++) {
+            struct log_slot *slot = &ring->slots[tail % LOG_RING_SLOTS];
+            syslog(slot->level, "%s", slot->msg);
+            logged++;
+        }
+        __atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+        unsigned dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+        if (dropped)
+            syslog(LOG_WARNING, "%u log messages dropped", dropped);
+
+        if (orphaned) { // nothing can be queued anymore, head was read after orphaned
+            // the first ring may have new rings in front of it by now
+            pthread_mutex_lock(&logger.lock);
+            struct log_ring **link = prev ? &prev->next : &logger.rings;
+            while (*link != ring)
+                link = &(*link)->next;
+            *link = next;
+            pthread_mutex_unlock(&logger.lock);
+            free(ring);
+        } else {
+            prev = ring;
+        }
+        ring = next;
+    }
+    return logged;
+}
+
+static void *log_main(void *arg) {
+    while (__atomic_load_n(&logger.running, __ATOMIC_ACQUIRE)) {
+        if (drain_rings())
+            continue;
+        // announce the sleep, then look again for a message queued before log_write() could
+        // see it
+        __atomic_store_n(&logger.idle, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (drain_rings() == 0 && __atomic_load_n(&logger.running, __ATOMIC_ACQUIRE)) {
+            eventfd_t count;
+            eventfd_read(logger.wake_fd, &count);
+        }
+        __atomic_store_n(&logger.idle, 0, __ATOMIC_RELAXED);
+    }
+    drain_rings();
+    return NULL;
+}
+
+/**
+ * Starts the log thread, must be called after the daemon fork.
+ * @return 0 on success, -1 on failure (messages then go straight to syslog).
+ */
+int log_init(void) {
+    logger.wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (logger.wake_fd < 0)
+        return -1;
+    if (pthread_key_create(&logger.key, ring_orphan)) {
+        close(logger.wake_fd);
+        return -1;
+    }
+    logger.running = 1;
+    if (pthread_create(&logger.thread, NULL, log_main, NULL)) {
+        logger.running = 0;
+        pthread_key_delete(logger.key);
+        close(logger.wake_fd);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Logs the queued messages and stops the log thread, once every other thread has stopped
+ * logging.
+ */
+void log_shutdown(void) {
+    if (!logger.running)
+        return;
+    __atomic_store_n(&logger.running, 0, __ATOMIC_RELEASE);
+    eventfd_write(logger.wake_fd, 1);
+    pthread_join(logger.thread, NULL);
+    pthread_key_delete(logger.key);
+    close(logger.wake_fd);
+    while (logger.rings) {
+        struct log_ring *ring = logger.rings;
+        logger.rings = ring->next;
+        free(ring);
+    }
+    thread_ring = NULL;
+}
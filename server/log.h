@@ -0,0 +1,33 @@
+/*
+ * log.h
+ *
+ * Asynchronous logging: messages are queued in per-thread rings and handed to syslog by a
+ * background thread, so that logging never blocks a connection.
+ */
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <syslog.h>
+
+// messages above this level are compiled out (make LOG_LEVEL=7 keeps the debug messages)
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_INFO
+#endif
+
+#define LOG_RATE_LIMIT 1000 // messages per second and thread, the excess is dropped and counted
+
+/**
+ * Logs a printf style message at the syslog @param level.
+ */
+#define log_msg(level, ...)                                                                    \
+    do {                                                                                       \
+        if ((level) <= LOG_COMPILE_LEVEL)                                                      \
+            log_write((level), __VA_ARGS__);                                                   \
+    } while (0)
+
+void log_write(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+int log_init(void);
+void log_shutdown(void);
+
+#endif /* LOG_H */
@@ -0,0 +1,121 @@
+/**
+ * @file metrics.c
+ * @brief Lock-free counters and histograms describing the server activity
+ *
+ * Every counter and histogram bucket is a 64 bit integer updated with a relaxed atomic add, so
+ * recording never takes a lock and never blocks a connection. Histograms have one bucket per
+ * power of two, which is plenty to follow quantiles over orders of magnitude. A dump reads the
+ * values one by one: it is not an atomic snapshot, but every value in it is exact.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "metrics.h"
+
+#define HISTOGRAM_BUCKETS 64 // bucket i counts the values in [2^(i-1), 2^i), bucket 0 counts 0
+
+uint64_t metric_counters[M_COUNTERS];
+
+static struct {
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+    uint64_t sum;
+} histograms[M_HISTOGRAMS];
+
+static uint64_t start_time;
+
+static const char *counter_names[M_COUNTERS] = {
+    [M_CONN_ACCEPTED] = "connections_accepted",
+    [M_CONN_ACTIVE] = "connections_active",
+    [M_PACKETS_IN] = "packets_in",
+    [M_BYTES_IN] = "bytes_in",
+    [M_REPLIES] = "replies",
+    [M_BYTES_OUT] = "bytes_out",
+    [M_TIMESTAMPS] = "timestamps",
+    [M_CONN_TIMEOUTS] = "connections_timed_out",
+    [M_CONN_OVERSIZED] = "connections_oversized",
+    [M_SEGMENTS_DROPPED] = "segments_dropped",
+};
+
+static const char *histogram_names[M_HISTOGRAMS] = {
+    [H_REPLY_BYTES] = "reply_bytes",
+    [H_LATENCY_US] = "latency_us",
+    [H_HISTORY_WAIT_US] = "history_wait_us",
+};
+
+/**
+ * @return a monotonic timestamp in nanoseconds.
+ */
+uint64_t metrics_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void metrics_init(void) {
+    memset(metric_counters, 0, sizeof(metric_counters));
+    memset(histograms, 0, sizeof(histograms));
+    start_time = metrics_now();
+}
+
+/**
+ * Counts @param value in the histogram @param histogram.
+ */
+void metrics_record(enum metric_histogram histogram, uint64_t value) {
+    int bucket = value ? 64 - __builtin_clzll(value) : 0;
+    if (bucket >= HISTOGRAM_BUCKETS)
+        bucket = HISTOGRAM_BUCKETS - 1;
+    __atomic_add_fetch(&histograms[histogram].buckets[bucket], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&histograms[histogram].sum, value, __ATOMIC_RELAXED);
+}
+
+/**
+ * @return the upper bound of the bucket holding the @param q quantile of @param buckets, which
+ * hold @param count values.
+ */
+static uint64_t quantile(const uint64_t *buckets, uint64_t count, double q) {
+    uint64_t rank = (uint64_t)(q * count), seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen > rank)
+            return i == HISTOGRAM_BUCKETS - 1 ? UINT64_MAX : (1ull << i) - 1;
+    }
+    return 0;
+}
+
+/**
+ * Writes the metrics to @param buf as "<name> <value>\n" lines, histograms as their count, sum
+ * and p50/p90/p99/p999 quantiles (upper bounds of power of two buckets).
+ * @return the number of bytes written (at most @param size - 1).
+ */
+size_t metrics_format(char *buf, size_t size) {
+    size_t len = 0;
+#define APPEND(...)                                                                            \
+    do {                                                                                       \
+        int n = snprintf(buf + len, size - len, __VA_ARGS__);                                  \
+        len += (n > 0 && (size_t)n < size - len) ? (size_t)n : 0;                              \
+    } while (0)
+
+    APPEND("uptime_s %llu\n", (unsigned long long)((metrics_now() - start_time) / 1000000000ull));
+    for (int i = 0; i < M_COUNTERS; i++) {
+        APPEND("%s %llu\n", counter_names[i],
+               (unsigned long long)__atomic_load_n(&metric_counters[i], __ATOMIC_RELAXED));
+    }
+    for (int i = 0; i < M_HISTOGRAMS; i++) {
+        uint64_t buckets[HISTOGRAM_BUCKETS], count = 0;
+        for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+            buckets[b] = __atomic_load_n(&histograms[i].buckets[b], __ATOMIC_RELAXED);
+            count += buckets[b];
+        }
+        const char *name = histogram_names[i];
+        APPEND("%s_count %llu\n", name, (unsigned long long)count);
+        APPEND("%s_sum %llu\n", name,
+               (unsigned long long)__atomic_load_n(&histograms[i].sum, __ATOMIC_RELAXED));
+        APPEND("%s_p50 %llu\n", name, (unsigned long long)quantile(buckets, count, 0.5));
+        APPEND("%s_p90 %llu\n", name, (unsigned long long)quantile(buckets, count, 0.9));
+        APPEND("%s_p99 %llu\n", name, (unsigned long long)quantile(buckets, count, 0.99));
+        APPEND("%s_p999 %llu\n", name, (unsigned long long)quantile(buckets, count, 0.999));
+    }
+#undef APPEND
+    return len;
+}
@@ -0,0 +1,49 @@
+/*
+ * metrics.h
+ *
+ * Lock-free counters and histograms describing the server activity, dumped by the STATS command.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum metric_counter {
+    M_CONN_ACCEPTED,
+    M_CONN_ACTIVE, // gauge: accepted and not closed yet
+    M_PACKETS_IN,  // complete packets appended to the history
+    M_BYTES_IN,    // bytes appended to the history
+    M_REPLIES,     // responses sent (history replays and STATS dumps)
+    M_BYTES_OUT,   // response bytes, headers included
+    M_TIMESTAMPS,  // timestamp records appended to the history
+    M_CONN_TIMEOUTS, // connections dropped by the read/write idle timeouts
+    M_CONN_OVERSIZED, // connections dropped for a packet over config.max_packet
+    M_SEGMENTS_DROPPED, // history segments dropped by the retention limits
+    M_COUNTERS,
+};
+
+enum metric_histogram {
+    H_REPLY_BYTES,       // size of the responses
+    H_LATENCY_US,        // from the receipt of a packet's new line to the end of its response
+    H_HISTORY_WAIT_US,   // time appends wait for the history (commit lock, group commit)
+    M_HISTOGRAMS,
+};
+
+extern uint64_t metric_counters[M_COUNTERS];
+
+void metrics_init(void);
+uint64_t metrics_now(void);
+
+/**
+ * Adds @param delta to the counter @param counter.
+ */
+static inline void metrics_add(enum metric_counter counter, int64_t delta) {
+    __atomic_add_fetch(&metric_counters[counter], (uint64_t)delta, __ATOMIC_RELAXED);
+}
+
+void metrics_record(enum metric_histogram histogram, uint64_t value);
+size_t metrics_format(char *buf, size_t size);
+
+#endif /* METRICS_H */
@@ -0,0 +1,218 @@
+/**
+ * @file pool.c
+ * @brief Worker thread pool engine for aesdsocket
+ *
+ * The calling thread accepts connections and hands them to a fixed number of worker threads
+ * through a bounded queue. Workers serve one connection at a time on a blocking socket, so
+ * run_client_request() runs each request to completion. The number of accepted connections
+ * that are not finished yet is capped by config.max_inflight, what happens above that cap is
+ * decided by config.overload. The idle timeouts are socket receive/send timeouts, so a client
+ * that stops sending or reading only holds its worker that long.
+ */
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "aesdsocket.h"
+#include "bqueue.h"
+#include "metrics.h"
+#include "log.h"
+
+struct worker_pool {
+    struct bqueue queue; // accepted connections waiting for a worker
+    pthread_t *threads;
+    connection_info **active; // connection currently served by each worker
+    int nthreads;
+    int inflight; // queued + active connections
+    pthread_mutex_t lock;
+    int room_fd; // eventfd signaled whenever a connection finishes
+};
+
+struct worker_arg {
+    struct worker_pool *pool;
+    int index;
+};
+
+static void *worker_main(void *arg) {
+    struct worker_pool *pool = ((struct worker_arg *)arg)->pool;
+    int index = ((struct worker_arg *)arg)->index;
+    free(arg);
+
+    connection_info *info;
+    while ((info = bqueue_pop(&pool->queue)) != NULL) {
+        pthread_mutex_lock(&pool->lock);
+        pool->active[index] = info;
+        pthread_mutex_unlock(&pool->lock);
+
+        // blocking socket: returns once the request is finished, or when a socket timeout
+        // expired (the socket then reports EAGAIN)
+        if (!run_client_request(info)) {
+            log_msg(LOG_INFO, "Connection from %s timed out while %s", info->client_ip,
+                    info->state == CONN_RECV ? "receiving" : "replying");
+            metrics_add(M_CONN_TIMEOUTS, 1);
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        pool->active[index] = NULL;
+        pthread_mutex_unlock(&pool->lock);
+        close_connection(info);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->inflight--;
+        pthread_mutex_unlock(&pool->lock);
+        uint64_t one = 1;
+        if (write(pool->room_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            log_msg(LOG_WARNING, "Failed to signal the accepting thread: %s", strerror(errno));
+    }
+    return NULL;
+}
+
+/**
+ * Sets the socket option @param option of @param fd to the timeout of @param ms milliseconds.
+ */
+static void set_socket_timeout(int fd, int option, int ms) {
+    struct timeval tv = {.tv_sec = ms / 1000, .tv_usec = (ms % 1000) * 1000};
+    if (ms && setsockopt(fd, SOL_SOCKET, option, &tv, sizeof(tv)))
+        log_msg(LOG_WARNING, "Failed to set a socket timeout: %s", strerror(errno));
+}
+
+/**
+ * Waits until the in-flight limit allows one more connection, or the server is stopped. The
+ * wait is a ppoll() on room_fd with @param wait_mask, so that SIGINT/SIGTERM interrupt it.
+ * @return 1 if a connection may be accepted.
+ */
+static int wait_for_room(struct worker_pool *pool, const sigset_t *wait_mask) {
+    struct pollfd pfd = {.fd = pool->room_fd, .events = POLLIN};
+    uint64_t finished;
+    while (run) {
+        pthread_mutex_lock(&pool->lock);
+        int full = pool->inflight >= config.max_inflight;
+        pthread_mutex_unlock(&pool->lock);
+        if (!full)
+            break;
+        // a connection finishing after the check leaves room_fd readable, it is not missed
+        if (ppoll(&pfd, 1, NULL, wait_mask) < 0 && errno != EINTR) {
+            log_msg(LOG_ERR, "poll failed: %s", strerror(errno));
+            return 0;
+        }
+        if (read(pool->room_fd, &finished, sizeof(finished)) < 0 && errno != EAGAIN)
+            log_msg(LOG_WARNING, "Failed to read the pool eventfd: %s", strerror(errno));
+    }
+    return run;
+}
+
+int run_pool(int listen_fd, const sigset_t *wait_mask) {
+    struct worker_pool pool;
+    memset(&pool, 0, sizeof(pool));
+    pool.nthreads = config.workers;
+    pool.threads = calloc(pool.nthreads, sizeof(pthread_t));
+    pool.active = calloc(pool.nthreads, sizeof(connection_info *));
+    pool.room_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (!pool.threads || !pool.active || pool.room_fd < 0 ||
+        bqueue_init(&pool.queue, config.max_inflight)) {
+        log_msg(LOG_ERR, "Failed to allocate the worker pool");
+        if (pool.room_fd >= 0)
+            close(pool.room_fd);
+        free(pool.threads);
+        free(pool.active);
+        return -1;
+    }
+    pthread_mutex_init(&pool.lock, NULL);
+
+    int started;
+    for (started = 0; started < pool.nthreads; started++) {
+        struct worker_arg *arg = malloc(sizeof(struct worker_arg));
+        if (!arg) {
+            log_msg(LOG_ERR, "Failed to allocate worker thread %d", started);
+            run = 0;
+            break;
+        }
+        arg->pool = &pool;
+        arg->index = started;
+        if (pthread_create(&pool.threads[started], NULL, worker_main, arg)) {
+            log_msg(LOG_ERR, "Failed to start worker thread %d", started);
+            free(arg);
+            run = 0;
+            break;
+        }
+    }
+    log_msg(LOG_DEBUG, "Started %d worker threads, at most %d connections in flight", started,
+            config.max_inflight);
+
+    struct pollfd pfd = {.fd = listen_fd, .events = POLLIN};
+    int ret = 0;
+    while (run) {
+        if (config.overload == OVERLOAD_WAIT && !wait_for_room(&pool, wait_mask))
+            break;
+
+        // sleep until a connection is pending
+        if (ppoll(&pfd, 1, NULL, wait_mask) < 0) {
+            if (errno == EINTR)
+                continue;
+            log_msg(LOG_ERR, "poll failed: %s", strerror(errno));
+            ret = -1;
+            break;
+        }
+
+        struct sockaddr_in client;
+        socklen_t size = sizeof(client);
+        int fd = accept(listen_fd, (struct sockaddr *)&client, &size);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                log_msg(LOG_ERR, "Failed to connect to client: %s", strerror(errno));
+            continue;
+        }
+        set_socket_timeout(fd, SO_RCVTIMEO, config.read_timeout);
+        set_socket_timeout(fd, SO_SNDTIMEO, config.write_timeout);
+
+        pthread_mutex_lock(&pool.lock);
+        int overloaded = pool.inflight >= config.max_inflight;
+        if (!overloaded)
+            pool.inflight++;
+        pthread_mutex_unlock(&pool.lock);
+        if (overloaded) { // only reachable with OVERLOAD_DROP
+            log_msg(LOG_WARNING, "Too many connections in flight, dropping a new connection");
+            close(fd);
+            continue;
+        }
+
+        connection_info *info = new_connection(fd, &client, 0);
+        if (!info) {
+            close(fd);
+            pthread_mutex_lock(&pool.lock);
+            pool.inflight--;
+            pthread_mutex_unlock(&pool.lock);
+            continue;
+        }
+        // the queue holds up to max_inflight entries, so this never waits
+        bqueue_push(&pool.queue, info);
+    }
+
+    // Stop the workers: release the queued connections and interrupt the active ones
+    bqueue_close(&pool.queue);
+    connection_info *info;
+    while ((info = bqueue_try_pop(&pool.queue)) != NULL)
+        close_connection(info);
+    pthread_mutex_lock(&pool.lock);
+    for (int i = 0; i < pool.nthreads; i++) {
+        if (pool.active[i])
+            shutdown(pool.active[i]->fd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&pool.lock);
+    for (int i = 0; i < started; i++)
+        pthread_join(pool.threads[i], NULL);
+
+    close(pool.room_fd);
+    pthread_mutex_destroy(&pool.lock);
+    bqueue_destroy(&pool.queue);
+    free(pool.active);
+    free(pool.threads);
+    return ret;
+}
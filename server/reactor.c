@@ -0,0 +1,173 @@
+/**
+ * @file reactor.c
+ * @brief Single threaded, edge-triggered epoll engine for aesdsocket
+ *
+ * The listening socket and every client socket are multiplexed on one epoll instance, client
+ * requests are advanced by run_client_request() whenever their socket becomes ready. The same
+ * engine serves the binary protocol listener, on a thread of its own.
+ *
+ * Open connections are kept in two lists, those receiving a packet and those sending a reply,
+ * each ordered by last activity. As every connection of a list has the same timeout
+ * (config.read_timeout / config.write_timeout), the ones that expired are at the head of their
+ * list and the epoll wait only has to last until the earliest head expires.
+ */
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include "aesdsocket.h"
+#include "metrics.h"
+#include "log.h"
+
+#define MAX_EVENTS 64 // maximum number of events handled per epoll_wait() call
+
+/**
+ * Accepts all the pending connections on the (edge-triggered) listening socket and registers
+ * them with the epoll instance @param epfd, as @param binary protocol connections or not.
+ */
+static void accept_connections(int listen_fd, int binary, int epfd,
+                               connection_queue_head_t *connections) {
+    while (1) {
+        struct sockaddr_in client;
+        socklen_t size = sizeof(client);
+        int fd = accept4(listen_fd, (struct sockaddr *)&client, &size, SOCK_NONBLOCK);
+        if (fd < 0) {
+            if (errno == EINTR)
+                continue;
+            // EAGAIN means there are no more pending connections
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                log_msg(LOG_ERR, "Failed to connect to client: %s", strerror(errno));
+            return;
+        }
+
+        connection_info *info = new_connection(fd, &client, binary);
+        if (!info) {
+            close(fd);
+            continue;
+        }
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = info;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)) {
+            log_msg(LOG_ERR, "Failed to watch connection from %s: %s", info->client_ip,
+                    strerror(errno));
+            close_connection(info);
+            continue;
+        }
+        TAILQ_INSERT_TAIL(connections, info, entries);
+    }
+}
+
+/**
+ * Drops the connections of @param waiting (indexed by connection state) that stayed idle for
+ * longer than the timeout of their state.
+ * @return the number of milliseconds until the next connection may expire, -1 if none can.
+ */
+static int expire_connections(connection_queue_head_t *waiting) {
+    const int timeouts[] = {[CONN_RECV] = config.read_timeout,
+                            [CONN_REPLAY] = config.write_timeout};
+    uint64_t now = metrics_now();
+    int next = -1;
+    for (int state = CONN_RECV; state <= CONN_REPLAY; state++) {
+        if (!timeouts[state])
+            continue;
+        uint64_t timeout = (uint64_t)timeouts[state] * 1000000;
+        connection_info *info;
+        while ((info = TAILQ_FIRST(&waiting[state])) != NULL) {
+            if (info->last_active + timeout > now) {
+                // round up so that the wait doesn't end just before the expiry
+                int left = (info->last_active + timeout - now + 999999) / 1000000;
+                if (next < 0 || left < next)
+                    next = left;
+                break;
+            }
+            log_msg(LOG_INFO, "Connection from %s timed out while %s", info->client_ip,
+                    state == CONN_RECV ? "receiving" : "replying");
+            metrics_add(M_CONN_TIMEOUTS, 1);
+            TAILQ_REMOVE(&waiting[state], info, entries);
+            close_connection(info);
+        }
+    }
+    return next;
+}
+
+static int reactor_loop(int listen_fd, int binary, const sigset_t *wait_mask) {
+    // open connections, by state (receiving or replying) and in last activity order
+    connection_queue_head_t waiting[CONN_REPLAY + 1];
+    TAILQ_INIT(&waiting[CONN_RECV]);
+    TAILQ_INIT(&waiting[CONN_REPLAY]);
+
+    // the listening socket is registered with a NULL pointer, client sockets with their
+    // connection_info
+    int epfd = epoll_create1(0);
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
+    if (epfd < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev)) {
+        log_msg(LOG_ERR, "Failed to setup epoll: %s", strerror(errno));
+        if (epfd >= 0)
+            close(epfd);
+        return -1;
+    }
+
+    int ret = 0;
+    struct epoll_event events[MAX_EVENTS];
+    while (run) {
+        // sleep until there is some work to do, or an idle connection times out
+        int timeout = expire_connections(waiting);
+        int n = epoll_pwait(epfd, events, MAX_EVENTS, timeout, wait_mask);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            log_msg(LOG_ERR, "epoll_wait failed: %s", strerror(errno));
+            ret = -1;
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            connection_info *info = events[i].data.ptr;
+            if (info == NULL) {
+                accept_connections(listen_fd, binary, epfd, &waiting[CONN_RECV]);
+                continue;
+            }
+            // the connection is listed under the state it was left in
+            enum conn_state before = info->state;
+            if (run_client_request(info)) {
+                TAILQ_REMOVE(&waiting[before], info, entries);
+                close_connection(info);
+                continue;
+            }
+            // only what the timeout of the state is waiting for counts as activity: a client
+            // that keeps sending while it doesn't read its reply still times out
+            uint32_t progress = info->state == CONN_RECV ? EPOLLIN : EPOLLOUT;
+            if (info->state != before || (events[i].events & progress)) {
+                TAILQ_REMOVE(&waiting[before], info, entries);
+                info->last_active = metrics_now();
+                TAILQ_INSERT_TAIL(&waiting[info->state], info, entries);
+            }
+        }
+    }
+
+    // Close all the connections that are still in progress
+    for (int state = CONN_RECV; state <= CONN_REPLAY; state++) {
+        while (!TAILQ_EMPTY(&waiting[state])) {
+            connection_info *info = TAILQ_FIRST(&waiting[state]);
+            TAILQ_REMOVE(&waiting[state], info, entries);
+            close_connection(info);
+        }
+    }
+    close(epfd);
+    return ret;
+}
+
+int run_reactor(int listen_fd, const sigset_t *wait_mask) {
+    return reactor_loop(listen_fd, 0, wait_mask);
+}
+
+int run_binary_reactor(int listen_fd, const sigset_t *wait_mask) {
+    return reactor_loop(listen_fd, 1, wait_mask);
+}
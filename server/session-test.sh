@@ -0,0 +1,103 @@
+#!/bin/bash
+# Tests the session mode (-s) of aesdsocket against both history backends: the data file, and
+# the char device when /dev/aesdchar exists (the driver is loaded).
+# Every reply of a session is "LEN:<n>\n" followed by the whole history, or by the history from
+# the position set by the AESDCHAR_IOCSEEKTO command it answers.
+# Usage: ./session-test.sh
+
+set -u
+
+cd "$(dirname "$0")"
+PORT=9000
+failed=0
+
+# reads a reply on fd 3 into $reply
+read_reply() {
+    local header
+    read -r -u 3 -t 5 header || return 1
+    [[ "$header" == LEN:* ]] || return 1
+    local len=${header#LEN:}
+    reply=""
+    if [ "$len" -gt 0 ]; then
+        IFS= read -r -u 3 -t 5 -N "$len" reply || return 1
+    fi
+}
+
+# runs the session checks against a server listening on $PORT, $1 names the backend
+check_session() {
+    local lines="" expected
+    exec 3<>/dev/tcp/localhost/$PORT || return 1
+    for i in 1 2 3 4 5; do
+        printf 'session %s line %d\n' "$1" "$i" >&3
+        lines+="session $1 line $i"$'\n'
+        read_reply || { echo "$1: no reply to packet $i"; return 1; }
+        # the device may hold older commands: what this session wrote ends the history
+        if [[ "$reply" != *"$lines" ]]; then
+            echo "$1: reply to packet $i doesn't end with the whole session:"
+            echo "$reply"
+            return 1
+        fi
+    done
+    # the second command of the session, from its start: count the commands of the history
+    local commands=${reply//[^$'\n']/}
+    printf 'AESDCHAR_IOCSEEKTO:%d,0\n' $((${#commands} - 4)) >&3
+    read_reply || { echo "$1: no reply to the seek command"; return 1; }
+    expected=${lines#*$'\n'}
+    if [ "$reply" != "$expected" ]; then
+        echo "$1: reply to the seek command is not the history from the seek position:"
+        echo "$reply"
+        return 1
+    fi
+    # the seek only applies to the reply of that command
+    printf 'session %s line 6\n' "$1" >&3
+    lines+="session $1 line 6"$'\n'
+    read_reply || { echo "$1: no reply to packet 6"; return 1; }
+    if [[ "$reply" != *"$lines" ]]; then
+        echo "$1: reply after the seek command is not the whole history:"
+        echo "$reply"
+        return 1
+    fi
+    # a seek command split over several sends, in its prefix and in its arguments
+    printf 'AESDCHAR_IOC' >&3
+    sleep 0.2
+    printf 'SEEKTO:%d,' $((${#commands} - 4)) >&3
+    sleep 0.2
+    printf '2\n' >&3
+    read_reply || { echo "$1: no reply to the split seek command"; return 1; }
+    expected=${lines#*$'\n'}
+    if [ "$reply" != "${expected:2}" ]; then
+        echo "$1: reply to the split seek command is not the history from the seek position:"
+        echo "$reply"
+        return 1
+    fi
+    exec 3<&-
+}
+
+# builds aesdsocket with the make arguments $2 and runs the checks, $1 names the backend
+run_backend() {
+    make clean >/dev/null
+    if ! make "$2" >/dev/null; then
+        echo "$1: build failed"
+        failed=1
+        return
+    fi
+    ./aesdsocket -s &
+    local pid=$!
+    sleep 1
+    if check_session "$1"; then
+        echo "$1: session test passed"
+    else
+        failed=1
+    fi
+    kill "$pid"
+    wait "$pid"
+}
+
+run_backend "data file" CFLAGS=-DUSE_AESD_CHAR_DEVICE=0
+if [ -c /dev/aesdchar ]; then
+    run_backend "char device" CFLAGS=-DUSE_AESD_CHAR_DEVICE=1
+else
+    echo "char device: skipped, /dev/aesdchar doesn't exist"
+fi
+make clean >/dev/null
+exit $failed
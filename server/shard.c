@@ -0,0 +1,88 @@
+/**
+ * @file shard.c
+ * @brief SO_REUSEPORT sharding for aesdsocket
+ *
+ * Every shard owns one of the SO_REUSEPORT listening sockets opened by main() and runs its own
+ * instance of the configured engine on a thread pinned to a CPU. The kernel spreads incoming
+ * connections over the listeners, so accepting never funnels through a single thread and the
+ * shards share nothing but the history.
+ */
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "aesdsocket.h"
+#include "log.h"
+
+struct shard {
+    pthread_t thread;
+    int listen_fd;
+    int cpu;
+    const sigset_t *wait_mask;
+    int ret; // engine return value
+};
+
+static void *shard_main(void *arg) {
+    struct shard *shard = arg;
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(shard->cpu, &cpuset);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset))
+        log_msg(LOG_WARNING, "Failed to pin the shard of listener %d to CPU %d",
+                shard->listen_fd, shard->cpu);
+    log_msg(LOG_DEBUG, "Shard on CPU %d serving listener %d", shard->cpu, shard->listen_fd);
+    shard->ret = run_engine(shard->listen_fd, shard->wait_mask);
+    // the signal that stopped this shard was only delivered to this thread: pass it on, the
+    // next shard stopping does the same until every shard is gone
+    run = 0;
+    kill(getpid(), SIGTERM);
+    return NULL;
+}
+
+int run_shards(const int *listen_fds, int nshards, const sigset_t *wait_mask) {
+    struct shard *shards = calloc(nshards, sizeof(struct shard));
+    if (!shards) {
+        log_msg(LOG_ERR, "Failed to allocate the shards");
+        return -1;
+    }
+
+    // shards are spread round robin over the CPUs we are allowed to run on
+    cpu_set_t allowed;
+    int cpus[CPU_SETSIZE], ncpus = 0;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed))
+                cpus[ncpus++] = cpu;
+        }
+    }
+    if (ncpus == 0)
+        cpus[ncpus++] = 0;
+
+    int started = 0, ret = 0;
+    for (; started < nshards; started++) {
+        struct shard *shard = &shards[started];
+        shard->listen_fd = listen_fds[started];
+        shard->cpu = cpus[started % ncpus];
+        shard->wait_mask = wait_mask;
+        int err = pthread_create(&shard->thread, NULL, shard_main, shard);
+        if (err) {
+            log_msg(LOG_ERR, "Failed to create shard %d: %s", started, strerror(err));
+            run = 0;
+            kill(getpid(), SIGTERM); // stop the shards already running
+            ret = -1;
+            break;
+        }
+    }
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(shards[i].thread, NULL);
+        if (shards[i].ret)
+            ret = -1;
+    }
+    free(shards);
+    return ret;
+}
@@ -0,0 +1,146 @@
+/**
+ * @file timestamp.c
+ * @brief Periodic timestamp records for aesdsocket
+ *
+ * One long-lived thread appends a "timestamp: ..." record to the history every
+ * config.timestamp_interval nanoseconds. The records go through history_append() like the
+ * client packets, so they are ordered with them (group commit, reservations and the cache
+ * included) and they also reach the char device. The deadlines are absolute on
+ * config.timestamp_clock: a slow append doesn't make the period drift, and ticks missed while
+ * the thread was held up are skipped rather than written in a burst.
+ *
+ * With CLOCK_REALTIME the record holds the local time in RFC 2822 format, with milliseconds
+ * added when the interval is not a whole number of seconds. With CLOCK_MONOTONIC it holds the
+ * seconds elapsed on that clock, with nanoseconds.
+ */
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "aesdsocket.h"
+#include "history.h"
+#include "metrics.h"
+#include "timestamp.h"
+#include "log.h"
+
+#define NSEC_PER_SEC 1000000000LL
+
+static struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake; // signaled by timestamp_stop()
+    int running;
+    int started;
+} ticker = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+/**
+ * Formats the timestamp record of @param now into @param buf of @param size bytes.
+ * @return the length of the record.
+ */
+static int format_timestamp(char *buf, size_t size, const struct timespec *now) {
+    if (config.timestamp_clock != CLOCK_REALTIME)
+        return snprintf(buf, size, "timestamp: %lld.%09ld\n", (long long)now->tv_sec,
+                        now->tv_nsec);
+
+    char date[80], zone[8] = "";
+    struct tm tm_info;
+    localtime_r(&now->tv_sec, &tm_info);
+    strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S", &tm_info);
+    strftime(zone, sizeof(zone), "%z", &tm_info);
+    if (config.timestamp_interval % NSEC_PER_SEC)
+        return snprintf(buf, size, "timestamp: %s.%03ld %s\n", date, now->tv_nsec / 1000000,
+                        zone);
+    return snprintf(buf, size, "timestamp: %s %s\n", date, zone);
+}
+
+static void *timestamp_main(void *arg) {
+    // the char device needs a descriptor of its own, the data file is shared
+    int fd = history_open();
+    if (fd < 0)
+        return NULL;
+
+    struct timespec deadline;
+    clock_gettime(config.timestamp_clock, &deadline);
+    pthread_mutex_lock(&ticker.lock);
+    while (ticker.running) {
+        int64_t next = deadline.tv_sec * NSEC_PER_SEC + deadline.tv_nsec +
+                       config.timestamp_interval;
+        struct timespec now;
+        clock_gettime(config.timestamp_clock, &now);
+        int64_t now_ns = now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+        if (next <= now_ns) // held up for more than a period: skip the missed ticks
+            next += (now_ns - next) / config.timestamp_interval * config.timestamp_interval +
+                    config.timestamp_interval;
+        deadline.tv_sec = next / NSEC_PER_SEC;
+        deadline.tv_nsec = next % NSEC_PER_SEC;
+
+        int err = 0;
+        while (ticker.running && err != ETIMEDOUT)
+            err = pthread_cond_timedwait(&ticker.wake, &ticker.lock, &deadline);
+        if (!ticker.running)
+            break;
+        pthread_mutex_unlock(&ticker.lock);
+
+        char line[128];
+        clock_gettime(config.timestamp_clock, &now);
+        int len = format_timestamp(line, sizeof(line), &now);
+        if (history_append(fd, line, len) != len)
+            log_msg(LOG_ERR, "Failed to write the timestamp to %s: %s", OUT_FILE,
+                    strerror(errno));
+        else
+            metrics_add(M_TIMESTAMPS, 1);
+
+        pthread_mutex_lock(&ticker.lock);
+    }
+    pthread_mutex_unlock(&ticker.lock);
+    history_close(fd);
+    return NULL;
+}
+
+/**
+ * Starts the timer thread, unless config.timestamp_interval is 0.
+ * @return 0 on success, -1 on failure.
+ */
+int timestamp_start(void) {
+    if (!config.timestamp_interval)
+        return 0;
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    int err = pthread_condattr_setclock(&attr, config.timestamp_clock);
+    if (!err)
+        err = pthread_cond_init(&ticker.wake, &attr);
+    pthread_condattr_destroy(&attr);
+    if (err) {
+        log_msg(LOG_ERR, "Failed to set up the timestamp clock: %s", strerror(err));
+        return -1;
+    }
+    ticker.running = 1;
+    err = pthread_create(&ticker.thread, NULL, timestamp_main, NULL);
+    if (err) {
+        log_msg(LOG_ERR, "Failed to create the timestamp thread: %s", strerror(err));
+        pthread_cond_destroy(&ticker.wake);
+        return -1;
+    }
+    ticker.started = 1;
+    return 0;
+}
+
+/**
+ * Stops the timer thread, waiting for a timestamp being written.
+ */
+void timestamp_stop(void) {
+    if (!ticker.started)
+        return;
+    pthread_mutex_lock(&ticker.lock);
+    ticker.running = 0;
+    pthread_cond_signal(&ticker.wake);
+    pthread_mutex_unlock(&ticker.lock);
+    pthread_join(ticker.thread, NULL);
+    pthread_cond_destroy(&ticker.wake);
+    ticker.started = 0;
+}
@@ -0,0 +1,13 @@
+/*
+ * timestamp.h
+ *
+ * Periodic timestamp records appended to the history by a single timer thread.
+ */
+
+#ifndef TIMESTAMP_H
+#define TIMESTAMP_H
+
+int timestamp_start(void);
+void timestamp_stop(void);
+
+#endif /* TIMESTAMP_H */
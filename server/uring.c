@@ -0,0 +1,740 @@
+/**
+ * @file uring.c
+ * @brief io_uring engine for aesdsocket
+ *
+ * Every socket and OUT_FILE operation (accept, recv, append write, optional fsync, replay read
+ * and send) is queued as an SQE, all the SQEs produced while handling a batch of completions
+ * are submitted with a single io_uring_enter() call. Connections are accepted with a multishot
+ * accept, and the connection buffers live in one region registered with the kernel so that file
+ * reads and writes use the fixed buffer opcodes. Data file replays skip the read: they are sent
+ * straight from the history cache or from the mapping of the log segment. The idle timeouts are linked timeouts on the
+ * recv and send SQEs: the kernel cancels an operation that makes no progress in time.
+ *
+ * The ring is driven through the raw system calls, the engine does not depend on liburing.
+ * Only built when the Makefile is invoked with IO_URING=1.
+ */
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "aesd_ioctl.h"
+#include "aesdsocket.h"
+#include "history.h"
+#include "metrics.h"
+#include "log.h"
+
+#define RING_ENTRIES 256
+
+// operation tags stored in the low bits of the SQE user_data, next to the connection pointer
+enum uring_op {
+    OP_ACCEPT,
+    OP_RECV,
+    OP_WRITE,
+    OP_WRITE_LINKED, // append write followed by a linked fsync, only its failure is reported
+    OP_FSYNC,
+    OP_READ,
+    OP_SEND,
+    OP_TIMEOUT, // linked timeout of a recv or send, its completion is ignored
+};
+#define OP_MASK 7
+
+struct uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned sq_entries;
+    unsigned sqe_tail; // local SQ tail, published to the kernel on submit
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len, sqes_len;
+    int fixed; // 1 if the connection buffers are registered with the kernel
+};
+
+struct uring_conn {
+    int fd;
+    int out_fd;
+    int nl_found;
+    char client_ip[INET_ADDRSTRLEN];
+    struct frame_rx rx; // received bytes not processed yet, BUFSIZ inside the registered region
+    const uint8_t *pkt; // packet (or piece of one) being appended to OUT_FILE, inside rx
+    size_t pkt_len;
+    off_t append_off; // history range reserved for the append, -1 with the char device
+    uint8_t *buffer;  // replay buffer, BUFSIZ bytes inside the registered region
+    const uint8_t *send_buf; // data being sent: buffer, the cached chunk or the segment
+    struct history_chunk *chunk; // cached chunk being sent, if any
+    struct history_segment *segment; // log segment being written to or sent from, if any
+    size_t len;       // number of valid bytes in send_buf
+    size_t sent;      // number of bytes of send_buf already sent back during the replay
+    off_t replay_off; // next replay read offset, -1 reads from the file position (char device)
+    size_t replay_left; // bytes of history left to read for this reply, SIZE_MAX: until EOF
+    off_t since;      // start offset requested by a SINCE command, -1: whole history
+    off_t seek_pos;   // history offset set by AESDCHAR_IOCSEEKTO, -1: none
+    int stats;        // STATS command: the response is the metrics dump
+    uint64_t rx_time; // metrics_now() when the current data was received
+    size_t replied;   // bytes of the current response sent, header included
+    size_t pkt_bytes; // bytes of the current packet received so far
+    TAILQ_ENTRY(uring_conn) entries;
+};
+TAILQ_HEAD(uring_conn_list, uring_conn);
+
+struct uring_engine {
+    struct uring ring;
+    int listen_fd;
+    struct uring_conn *conns; // preallocated connections, config.max_inflight of them
+    uint8_t *buffers;         // two BUFSIZ buffers (rx + replay) per connection
+    struct uring_conn_list free_conns;
+    struct uring_conn_list active_conns;
+    struct __kernel_timespec read_timeout, write_timeout; // read by the kernel on submission
+    struct __kernel_timespec accept_backoff; // pause before re-arming a failed accept
+    int failed; // the engine can't accept connections anymore and stops
+};
+
+static int uring_setup(struct uring *ring, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (ring->fd < 0)
+        return -1;
+
+    ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_len > ring->sq_len)
+            ring->sq_len = ring->cq_len;
+        ring->cq_len = ring->sq_len;
+    }
+    ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED)
+        goto fail;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = ring->sq_ptr;
+    } else {
+        ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED)
+            goto fail;
+    }
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        goto fail;
+
+    ring->sq_head = (unsigned *)((char *)ring->sq_ptr + p.sq_off.head);
+    ring->sq_tail = (unsigned *)((char *)ring->sq_ptr + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)((char *)ring->sq_ptr + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq_ptr + p.sq_off.array);
+    ring->cq_head = (unsigned *)((char *)ring->cq_ptr + p.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->cq_ptr + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)((char *)ring->cq_ptr + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ptr + p.cq_off.cqes);
+    ring->sq_entries = p.sq_entries;
+    ring->sqe_tail = *ring->sq_tail;
+    return 0;
+
+fail:
+    log_msg(LOG_ERR, "Failed to map the io_uring rings: %s", strerror(errno));
+    if (ring->sq_ptr && ring->sq_ptr != MAP_FAILED)
+        munmap(ring->sq_ptr, ring->sq_len);
+    if (ring->cq_ptr && ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr)
+        munmap(ring->cq_ptr, ring->cq_len);
+    close(ring->fd);
+    return -1;
+}
+
+static void uring_teardown(struct uring *ring) {
+    munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_ptr != ring->sq_ptr)
+        munmap(ring->cq_ptr, ring->cq_len);
+    munmap(ring->sq_ptr, ring->sq_len);
+    close(ring->fd);
+}
+
+/**
+ * Publishes the queued SQEs to the kernel and, if @param wait is set, sleeps until at least one
+ * completion is available. Signals in @param wait_mask are only delivered while sleeping.
+ */
+static int uring_submit(struct uring *ring, int wait, const sigset_t *wait_mask) {
+    unsigned to_submit = ring->sqe_tail - *ring->sq_tail;
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    return syscall(__NR_io_uring_enter, ring->fd, to_submit, wait ? 1 : 0,
+                   wait ? IORING_ENTER_GETEVENTS : 0, wait ? wait_mask : NULL, _NSIG / 8);
+}
+
+/**
+ * Makes room for @param count SQEs in the submission queue, handing what is queued to the kernel
+ * if needed. Linked SQEs are reserved together, so that the queue is never flushed between them.
+ * @return 0 on success, -1 if the queue is still too full.
+ */
+static int uring_reserve(struct uring *ring, unsigned count) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sqe_tail - head + count > ring->sq_entries) {
+        // SQ full: hand what we have to the kernel to make room
+        uring_submit(ring, 0, NULL);
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (ring->sqe_tail - head + count > ring->sq_entries) {
+            log_msg(LOG_ERR, "io_uring submission queue overflow");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct uring *ring) {
+    if (uring_reserve(ring, 1))
+        return NULL;
+    unsigned index = ring->sqe_tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    ring->sq_array[index] = index;
+    ring->sqe_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+/**
+ * Queues an operation on @param fd for @param c.
+ * @return the SQE, NULL if the submission queue is full.
+ */
+static struct io_uring_sqe *prep_rw(struct uring *ring, int opcode, struct uring_conn *c,
+                                    enum uring_op op, int fd, const void *addr, unsigned len,
+                                    off_t off) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (!sqe)
+        return NULL;
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)addr;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->user_data = (uintptr_t)c | op;
+    return sqe;
+}
+
+static void post_accept(struct uring_engine *e) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&e->ring);
+    if (!sqe)
+        return;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = e->listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = OP_ACCEPT;
+}
+
+/**
+ * Re-arms the accept once e->accept_backoff has elapsed, leaving the connections in flight some
+ * time to release their file descriptors.
+ */
+static void post_accept_backoff(struct uring_engine *e) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&e->ring);
+    if (!sqe)
+        return;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uintptr_t)&e->accept_backoff;
+    sqe->len = 1;
+    sqe->user_data = (uintptr_t)e | OP_TIMEOUT; // tagged with the engine, see handle_cqe()
+}
+
+/**
+ * Links a timeout of @param ts to @param target, the SQE queued last: the kernel cancels that
+ * operation (-ECANCELED) if it hasn't completed in time. Room for both SQEs must have been
+ * reserved before target was queued.
+ */
+static void link_timeout(struct uring_engine *e, struct io_uring_sqe *target,
+                         const struct __kernel_timespec *ts) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&e->ring);
+    if (!sqe)
+        return;
+    target->flags |= IOSQE_IO_LINK;
+    sqe->opcode = IORING_OP_LINK_TIMEOUT;
+    sqe->addr = (uintptr_t)ts;
+    sqe->len = 1;
+    sqe->user_data = OP_TIMEOUT;
+}
+
+static void release_conn(struct uring_engine *e, struct uring_conn *c);
+
+static void post_recv(struct uring_engine *e, struct uring_conn *c) {
+    if (uring_reserve(&e->ring, config.read_timeout ? 2 : 1)) {
+        release_conn(e, c);
+        return;
+    }
+    size_t room;
+    uint8_t *dest = frame_space(&c->rx, &room);
+    struct io_uring_sqe *sqe = prep_rw(&e->ring, IORING_OP_RECV, c, OP_RECV, c->fd, dest, room, 0);
+    if (sqe && config.read_timeout)
+        link_timeout(e, sqe, &e->read_timeout);
+}
+
+static void on_append(struct uring_engine *e, struct uring_conn *c, int res);
+static void on_replay_read(struct uring_engine *e, struct uring_conn *c, int res);
+
+static void post_append(struct uring_engine *e, struct uring_conn *c) {
+    int opcode = e->ring.fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    enum uring_op op = config.sync_writes ? OP_WRITE_LINKED : OP_WRITE;
+    int fd = c->out_fd;
+    off_t pos = -1;
+    // reserve the SQEs first: once the history range is reserved, the append must complete
+    if (uring_reserve(&e->ring, config.sync_writes ? 2 : 1)) {
+        c->append_off = -1;
+        on_append(e, c, -EBUSY);
+        return;
+    }
+    // data file: write at the reserved range of the log, in the data file of its segment,
+    // committed once written
+    // char device: offset -1, the driver appends
+    c->append_off = history_reserve(c->pkt_len);
+    if (c->append_off >= 0) {
+        size_t room = 0;
+        c->segment = history_segment_get(c->append_off, 1);
+        if (c->segment)
+            fd = history_segment_fd(c->segment, c->append_off, &pos, &room);
+        if (room < c->pkt_len) {
+            // the packet crosses into the next segment (or the segment could not be created),
+            // this happens once per segment: write it synchronously
+            int res = history_write(c->append_off, c->pkt, c->pkt_len) < 0 ? -errno : 0;
+            on_append(e, c, res);
+            return;
+        }
+    }
+    struct io_uring_sqe *sqe = prep_rw(&e->ring, opcode, c, op, fd, c->pkt, c->pkt_len, pos);
+    if (sqe && config.sync_writes) {
+        sqe->flags |= IOSQE_IO_LINK;
+        sqe = prep_rw(&e->ring, IORING_OP_FSYNC, c, OP_FSYNC, fd, NULL, 0, 0);
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    }
+}
+
+static void post_send(struct uring_engine *e, struct uring_conn *c);
+
+/**
+ * Sends the next part of the replay straight from the @param avail bytes of history at
+ * @param data (cached chunk or segment mapping).
+ */
+static void post_send_history(struct uring_engine *e, struct uring_conn *c, const char *data,
+                              size_t avail) {
+    c->send_buf = (const uint8_t *)data;
+    c->len = c->replay_left < avail ? c->replay_left : avail;
+    c->sent = 0;
+    c->replay_off += c->len;
+    c->replay_left -= c->len;
+    post_send(e, c);
+}
+
+static void post_replay_read(struct uring_engine *e, struct uring_conn *c) {
+    size_t avail;
+    // send straight from the in-memory cache when this part of the history is still there
+    if (c->replay_off >= 0 && config.cache_size &&
+        (c->chunk = history_cache_get(c->replay_off)) != NULL) {
+        const char *data = history_chunk_data(c->chunk, c->replay_off, &avail);
+        post_send_history(e, c, data, avail);
+        return;
+    }
+    // otherwise from the mapping of its segment
+    if (c->replay_off >= 0) {
+        c->segment = history_segment_get(c->replay_off, 0);
+        if (!c->segment) {
+            on_replay_read(e, c, 0); // that part of the log is missing
+            return;
+        }
+        const char *data = history_segment_data(c->segment, c->replay_off, &avail);
+        post_send_history(e, c, data, avail);
+        return;
+    }
+
+    int opcode = e->ring.fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    size_t chunk = c->replay_left < BUFSIZ ? c->replay_left : BUFSIZ;
+    if (!prep_rw(&e->ring, opcode, c, OP_READ, c->out_fd, c->buffer, chunk, c->replay_off))
+        release_conn(e, c);
+}
+
+static void post_send(struct uring_engine *e, struct uring_conn *c) {
+    if (uring_reserve(&e->ring, config.write_timeout ? 2 : 1)) {
+        release_conn(e, c);
+        return;
+    }
+    struct io_uring_sqe *sqe = prep_rw(&e->ring, IORING_OP_SEND, c, OP_SEND, c->fd,
+                                       c->send_buf + c->sent, c->len - c->sent, 0);
+    sqe->msg_flags = MSG_NOSIGNAL;
+    if (config.write_timeout)
+        link_timeout(e, sqe, &e->write_timeout);
+}
+
+static void release_conn(struct uring_engine *e, struct uring_conn *c) {
+    if (c->chunk)
+        history_chunk_put(c->chunk);
+    c->chunk = NULL;
+    if (c->segment)
+        history_segment_put(c->segment);
+    c->segment = NULL;
+    metrics_add(M_CONN_ACTIVE, -1);
+    history_close(c->out_fd);
+    close(c->fd);
+    log_msg(LOG_INFO, "Closed connection from %s", c->client_ip);
+    TAILQ_REMOVE(&e->active_conns, c, entries);
+    TAILQ_INSERT_HEAD(&e->free_conns, c, entries);
+}
+
+static void process_rx(struct uring_engine *e, struct uring_conn *c);
+
+static void finish_replay(struct uring_engine *e, struct uring_conn *c) {
+    metrics_add(M_REPLIES, 1);
+    metrics_add(M_BYTES_OUT, c->replied);
+    metrics_record(H_REPLY_BYTES, c->replied);
+    metrics_record(H_LATENCY_US, (metrics_now() - c->rx_time) / 1000);
+    if (config.session)
+        process_rx(e, c); // wait for (or handle the already received) next packet
+    else
+        release_conn(e, c);
+}
+
+static void start_conn_replay(struct uring_engine *e, struct uring_conn *c) {
+    c->replied = 0;
+    if (c->stats) { // the response is the metrics dump
+        c->stats = 0;
+        c->len = format_stats_reply(c->buffer, BUFSIZ);
+        c->replay_left = 0;
+        c->send_buf = c->buffer;
+        c->sent = 0;
+        post_send(e, c);
+        return;
+    }
+
+    // the data file is replayed up to its committed length, the char device from its file
+    // position which may have been moved by an AESDCHAR_IOCSEEKTO command
+    off_t start = c->since >= 0 ? c->since : c->seek_pos;
+    if (history_replay_window(c->out_fd, config.session, &start, &c->replay_off,
+                              &c->replay_left)) {
+        log_msg(LOG_ERR, "Failed to get the size of %s: %s", OUT_FILE, strerror(errno));
+        release_conn(e, c);
+        return;
+    }
+    c->len = format_reply_header((char *)c->buffer, BUFSIZ, c->since >= 0 ? start : -1,
+                                 c->replay_left);
+    c->since = -1;
+    c->seek_pos = -1;
+    if (c->len == 0) {
+        post_replay_read(e, c);
+        return;
+    }
+
+    // session mode or SINCE request: announce the size of the reply
+    c->send_buf = c->buffer;
+    c->sent = 0;
+    post_send(e, c);
+}
+
+/**
+ * Handles the received bytes that are not processed yet: appends them to OUT_FILE up to the
+ * first new line (or runs the seek command they hold), or receives more data if there are none.
+ */
+static void process_rx(struct uring_engine *e, struct uring_conn *c) {
+    struct frame_slice slice;
+    int more = !frame_next(&c->rx, '\n', &slice); // everything received was processed
+    // a command split over several receives is kept until its new line arrives
+    if (!more && !slice.complete && c->pkt_bytes == 0 && slice.len < c->rx.size &&
+        command_pending(slice.data, slice.len))
+        more = 1;
+    if (more) {
+        post_recv(e, c);
+        return;
+    }
+
+    if (c->out_fd < 0) {
+        c->out_fd = history_open();
+        if (c->out_fd < 0) {
+            release_conn(e, c);
+            return;
+        }
+    }
+
+    c->pkt = slice.data;
+    c->pkt_len = slice.len;
+    c->nl_found = slice.complete;
+    log_msg(LOG_DEBUG, "received %zu bytes and new line found %d\n", c->pkt_len, c->nl_found);
+
+    // only a whole line received at the start of a packet can be a command
+    int command = c->nl_found && c->pkt_bytes == 0;
+    struct aesd_seekto seekto;
+    if (command && parse_seekto(c->pkt, c->pkt_len, &seekto)) {
+        // there is no io_uring opcode for ioctl, the seek is done synchronously
+        if (history_seekto(c->out_fd, &seekto, &c->seek_pos))
+            log_msg(LOG_DEBUG, "Invalid seek from %s: %s", c->client_ip, strerror(errno));
+        c->append_off = -1;
+        on_append(e, c, 0);
+    } else if (command && parse_since(c->pkt, c->pkt_len, &c->since)) {
+        c->append_off = -1; // delta replay request, nothing to append
+        on_append(e, c, 0);
+    } else if (command && parse_stats(c->pkt, c->pkt_len)) {
+        c->stats = 1;
+        c->append_off = -1;
+        on_append(e, c, 0);
+    } else {
+        if (account_packet(&c->pkt_bytes, c->pkt_len, c->nl_found, c->client_ip)) {
+            release_conn(e, c);
+            return;
+        }
+        metrics_add(M_BYTES_IN, c->pkt_len);
+        if (c->nl_found)
+            metrics_add(M_PACKETS_IN, 1);
+        post_append(e, c);
+    }
+}
+
+static void on_accept(struct uring_engine *e, int res, unsigned flags) {
+    if (res < 0)
+        log_msg(LOG_ERR, "Failed to connect to client: %s", strerror(-res));
+    if (res == -EINVAL) { // the listening socket (or the multishot accept) is unusable
+        e->failed = 1;
+        return;
+    }
+    if (!(flags & IORING_CQE_F_MORE)) {
+        // the multishot accept was terminated, re-arm it, not right away when out of file
+        // descriptors: it would fail again as long as no connection is released
+        if (res == -EMFILE || res == -ENFILE)
+            post_accept_backoff(e);
+        else
+            post_accept(e);
+    }
+    if (res < 0)
+        return;
+
+    struct uring_conn *c = TAILQ_FIRST(&e->free_conns);
+    if (!c) {
+        log_msg(LOG_WARNING, "Too many connections in flight, dropping a new connection");
+        close(res);
+        return;
+    }
+    TAILQ_REMOVE(&e->free_conns, c, entries);
+    TAILQ_INSERT_TAIL(&e->active_conns, c, entries);
+    c->fd = res;
+    c->out_fd = -1;
+    c->nl_found = 0;
+    c->since = -1;
+    c->seek_pos = -1;
+    c->stats = 0;
+    frame_init(&c->rx, c->rx.data, c->rx.size);
+    c->pkt_bytes = 0;
+    c->len = 0;
+    c->sent = 0;
+
+    struct sockaddr_in client;
+    socklen_t size = sizeof(client);
+    if (getpeername(res, (struct sockaddr *)&client, &size) == 0)
+        inet_ntop(AF_INET, &client.sin_addr, c->client_ip, INET_ADDRSTRLEN);
+    else
+        strcpy(c->client_ip, "?");
+    log_msg(LOG_INFO, "Accepted connection from %s", c->client_ip);
+    metrics_add(M_CONN_ACCEPTED, 1);
+    metrics_add(M_CONN_ACTIVE, 1);
+    post_recv(e, c);
+}
+
+/**
+ * Drops the connection @param c whose recv or send was cancelled by its linked timeout.
+ */
+static void on_timeout(struct uring_engine *e, struct uring_conn *c, const char *doing) {
+    log_msg(LOG_INFO, "Connection from %s timed out while %s", c->client_ip, doing);
+    metrics_add(M_CONN_TIMEOUTS, 1);
+    release_conn(e, c);
+}
+
+static void on_recv(struct uring_engine *e, struct uring_conn *c, int res) {
+    if (res == -ECANCELED) {
+        on_timeout(e, c, "receiving");
+        return;
+    }
+    if (res <= 0) { // error or connection closed
+        log_msg(LOG_DEBUG, "Connection from %s closed before a new line was received",
+                c->client_ip);
+        release_conn(e, c);
+        return;
+    }
+    frame_received(&c->rx, res);
+    c->rx_time = metrics_now();
+    process_rx(e, c);
+}
+
+static void on_append(struct uring_engine *e, struct uring_conn *c, int res) {
+    if (res < 0)
+        log_msg(LOG_ERR, "Failed to write to %s: %s", OUT_FILE, strerror(-res));
+    if (c->segment) {
+        history_segment_put(c->segment);
+        c->segment = NULL;
+    }
+    if (c->append_off >= 0)
+        history_commit(c->append_off, c->pkt, c->pkt_len);
+    c->append_off = -1;
+    // whatever follows the new line is the start of the next pipelined packet
+    frame_consume(&c->rx, c->pkt_len);
+    if (c->nl_found)
+        start_conn_replay(e, c);
+    else
+        process_rx(e, c);
+}
+
+static void on_replay_read(struct uring_engine *e, struct uring_conn *c, int res) {
+    if (res <= 0) { // whole history sent (or failed to read it)
+        if (res < 0 || (c->replay_left != 0 && c->replay_left != SIZE_MAX)) {
+            log_msg(LOG_ERR, "Failed to read %s: %s", OUT_FILE, strerror(-res));
+            release_conn(e, c);
+        } else {
+            finish_replay(e, c);
+        }
+        return;
+    }
+    if (c->replay_off >= 0)
+        c->replay_off += res;
+    if (c->replay_left != SIZE_MAX)
+        c->replay_left -= res;
+    c->send_buf = c->buffer;
+    c->len = res;
+    c->sent = 0;
+    post_send(e, c);
+}
+
+static void on_send(struct uring_engine *e, struct uring_conn *c, int res) {
+    if (res == -ECANCELED) {
+        on_timeout(e, c, "replying");
+        return;
+    }
+    if (res < 0) {
+        log_msg(LOG_ERR, "Failed to send to %s: %s", c->client_ip, strerror(-res));
+        release_conn(e, c);
+        return;
+    }
+    c->sent += res;
+    c->replied += res;
+    if (c->sent < c->len) {
+        post_send(e, c);
+        return;
+    }
+    if (c->chunk) {
+        history_chunk_put(c->chunk);
+        c->chunk = NULL;
+    }
+    if (c->segment) {
+        history_segment_put(c->segment);
+        c->segment = NULL;
+    }
+    if (c->replay_left == 0)
+        finish_replay(e, c);
+    else
+        post_replay_read(e, c);
+}
+
+static void handle_cqe(struct uring_engine *e, const struct io_uring_cqe *cqe) {
+    struct uring_conn *c = (struct uring_conn *)(uintptr_t)(cqe->user_data & ~(uint64_t)OP_MASK);
+    switch (cqe->user_data & OP_MASK) {
+    case OP_ACCEPT:
+        on_accept(e, cqe->res, cqe->flags);
+        break;
+    case OP_RECV:
+        on_recv(e, c, cqe->res);
+        break;
+    case OP_WRITE_LINKED: // the linked fsync completion continues the request
+        if (cqe->res < 0)
+            log_msg(LOG_ERR, "Failed to write to %s: %s", OUT_FILE, strerror(-cqe->res));
+        break;
+    case OP_WRITE:
+    case OP_FSYNC:
+        on_append(e, c, cqe->res);
+        break;
+    case OP_READ:
+        on_replay_read(e, c, cqe->res);
+        break;
+    case OP_SEND:
+        on_send(e, c, cqe->res);
+        break;
+    case OP_TIMEOUT:
+        // a linked timeout carries no connection, its operation completes with -ECANCELED if it
+        // fired; the accept back-off timer is tagged with the engine instead
+        if (c)
+            post_accept(e);
+        break;
+    }
+}
+
+int run_uring(int listen_fd, const sigset_t *wait_mask) {
+    struct uring_engine e;
+    memset(&e, 0, sizeof(e));
+    e.listen_fd = listen_fd;
+    TAILQ_INIT(&e.free_conns);
+    TAILQ_INIT(&e.active_conns);
+
+    if (uring_setup(&e.ring, RING_ENTRIES)) {
+        log_msg(LOG_ERR, "Failed to setup io_uring: %s", strerror(errno));
+        return -1;
+    }
+
+    size_t nconns = config.max_inflight;
+    e.conns = calloc(nconns, sizeof(struct uring_conn));
+    e.buffers = aligned_alloc(4096, (nconns * 2 * BUFSIZ + 4095) & ~(size_t)4095);
+    if (!e.conns || !e.buffers) {
+        log_msg(LOG_ERR, "Failed to allocate %zu io_uring connections", nconns);
+        free(e.conns);
+        free(e.buffers);
+        uring_teardown(&e.ring);
+        return -1;
+    }
+    for (size_t i = 0; i < nconns; i++) {
+        frame_init(&e.conns[i].rx, e.buffers + 2 * i * BUFSIZ, BUFSIZ);
+        e.conns[i].buffer = e.conns[i].rx.data + BUFSIZ;
+        TAILQ_INSERT_TAIL(&e.free_conns, &e.conns[i], entries);
+    }
+
+    // register all the connection buffers as a single fixed buffer, if the memlock limit does
+    // not allow it the plain read/write opcodes are used instead
+    struct iovec iov = {.iov_base = e.buffers, .iov_len = nconns * 2 * BUFSIZ};
+    e.ring.fixed = syscall(__NR_io_uring_register, e.ring.fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0;
+    if (!e.ring.fixed)
+        log_msg(LOG_WARNING, "Failed to register io_uring buffers: %s", strerror(errno));
+
+    e.read_timeout.tv_sec = config.read_timeout / 1000;
+    e.read_timeout.tv_nsec = (config.read_timeout % 1000) * 1000000LL;
+    e.write_timeout.tv_sec = config.write_timeout / 1000;
+    e.write_timeout.tv_nsec = (config.write_timeout % 1000) * 1000000LL;
+    e.accept_backoff.tv_nsec = 100000000LL; // 100 ms
+
+    post_accept(&e);
+    int ret = 0;
+    while (run && !e.failed) {
+        // submit everything queued while handling the previous completions, and sleep until
+        // something completes
+        if (uring_submit(&e.ring, 1, wait_mask) < 0 && errno != EINTR && errno != EBUSY) {
+            log_msg(LOG_ERR, "io_uring_enter failed: %s", strerror(errno));
+            ret = -1;
+            break;
+        }
+
+        unsigned head = *e.ring.cq_head;
+        unsigned tail = __atomic_load_n(e.ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++)
+            handle_cqe(&e, &e.ring.cqes[head & *e.ring.cq_mask]);
+        __atomic_store_n(e.ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+    if (e.failed)
+        ret = -1;
+
+    // Close all the connections that are still in progress, tearing down the ring cancels
+    // their pending operations
+    uring_teardown(&e.ring);
+    while (!TAILQ_EMPTY(&e.active_conns))
+        release_conn(&e, TAILQ_FIRST(&e.active_conns));
+    free(e.buffers);
+    free(e.conns);
+    return ret;
+}
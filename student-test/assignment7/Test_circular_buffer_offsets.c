@@ -0,0 +1,162 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+
+/**
+ * Tests of aesd_circular_buffer_find_entry_offset_for_fpos(), a binary search over the
+ * cumulative entry offsets, and of first_offset/end_offset as the oldest entries are evicted.
+ */
+
+#define OFFSETS_TEST_WRITES 1200
+
+static char offsets_test_writes[OFFSETS_TEST_WRITES][24];
+
+/**
+ * Adds the write number @param number to @param buffer: a line of a length depending on the
+ * number, so that entries have different sizes.
+ * @return the size of the entry.
+ */
+static size_t offsets_test_add(struct aesd_circular_buffer *buffer, int number)
+{
+    struct aesd_buffer_entry entry;
+    snprintf(offsets_test_writes[number], sizeof(offsets_test_writes[number]), "w%d%.*s\n",
+            number, number % 7, "......");
+    entry.buffptr = offsets_test_writes[number];
+    entry.size = strlen(offsets_test_writes[number]);
+    aesd_circular_buffer_add_entry(buffer, &entry);
+    return entry.size;
+}
+
+/**
+ * Checks that char offset @param fpos of @param buffer is byte @param byte of @param expected
+ */
+static void offsets_test_find(struct aesd_circular_buffer *buffer, size_t fpos,
+        const struct aesd_buffer_entry *expected, size_t byte)
+{
+    size_t offset_rtn = (size_t)-1;
+    struct aesd_buffer_entry *entry =
+        aesd_circular_buffer_find_entry_offset_for_fpos(buffer, fpos, &offset_rtn);
+    TEST_ASSERT_EQUAL_PTR_MESSAGE(expected, entry, "Wrong entry for the char offset");
+    TEST_ASSERT_EQUAL_UINT64_MESSAGE(byte, offset_rtn, "Wrong byte offset in the entry");
+}
+
+/**
+ * Checks every char offset of @param buffer against a linear walk of its entries, and that the
+ * end of the buffer is not found.
+ */
+static void offsets_test_find_all(struct aesd_circular_buffer *buffer)
+{
+    uint32_t index, count = aesd_circular_buffer_count(buffer);
+    size_t fpos = 0, byte, offset_rtn;
+    for (index = 0; index < count; index++) {
+        struct aesd_buffer_entry *entry = aesd_circular_buffer_get_entry(buffer, index);
+        TEST_ASSERT_EQUAL_UINT64_MESSAGE(fpos, aesd_circular_buffer_entry_fpos(buffer, entry),
+                "Entries don't start where the previous one ends");
+        for (byte = 0; byte < entry->size; byte++)
+            offsets_test_find(buffer, fpos + byte, entry, byte);
+        fpos += entry->size;
+    }
+    TEST_ASSERT_EQUAL_UINT64(fpos, aesd_circular_buffer_size(buffer));
+    TEST_ASSERT_NULL_MESSAGE(
+        aesd_circular_buffer_find_entry_offset_for_fpos(buffer, fpos, &offset_rtn),
+        "The end of the buffer must not be found");
+}
+
+void test_circular_buffer_find_fpos_boundaries()
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry *first, *second, *last;
+    size_t offset_rtn, size0, size1, end = 0;
+    int i;
+    aesd_circular_buffer_init(&buffer);
+    TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, 0,
+            &offset_rtn), "Found an entry in an empty buffer");
+
+    size0 = offsets_test_add(&buffer, 0);
+    size1 = offsets_test_add(&buffer, 1);
+    end = size0 + size1;
+    for (i = 2; i < 5; i++)
+        end += offsets_test_add(&buffer, i);
+    first = aesd_circular_buffer_get_entry(&buffer, 0);
+    second = aesd_circular_buffer_get_entry(&buffer, 1);
+    last = aesd_circular_buffer_get_entry(&buffer, 4);
+
+    offsets_test_find(&buffer, 0, first, 0);
+    offsets_test_find(&buffer, size0 - 1, first, size0 - 1);
+    offsets_test_find(&buffer, size0, second, 0); // entry boundary
+    offsets_test_find(&buffer, size0 + size1, aesd_circular_buffer_get_entry(&buffer, 2), 0);
+    offsets_test_find(&buffer, end - 1, last, last->size - 1);
+    TEST_ASSERT_NULL(aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, end, &offset_rtn));
+    TEST_ASSERT_NULL(aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, end + 100,
+            &offset_rtn));
+    offsets_test_find_all(&buffer);
+}
+
+void test_circular_buffer_offsets_after_eviction()
+{
+    struct aesd_circular_buffer buffer;
+    size_t sizes[3 * AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED], written = 0, evicted = 0;
+    int i;
+    aesd_circular_buffer_init(&buffer);
+    for (i = 0; i < 3 * AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++) {
+        sizes[i] = offsets_test_add(&buffer, i);
+        written += sizes[i];
+        if (i >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
+            evicted += sizes[i - AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+        TEST_ASSERT_EQUAL_UINT64_MESSAGE(evicted, buffer.first_offset,
+                "first_offset must be the size of everything evicted");
+        TEST_ASSERT_EQUAL_UINT64_MESSAGE(written, buffer.end_offset,
+                "end_offset must be the size of everything written");
+        // the stream offset of an entry doesn't move as older ones are evicted
+        TEST_ASSERT_EQUAL_UINT64(written - sizes[i],
+                aesd_circular_buffer_get_entry(&buffer,
+                    aesd_circular_buffer_count(&buffer) - 1)->offset);
+        offsets_test_find_all(&buffer);
+    }
+    // char offset 0 is the oldest entry kept
+    offsets_test_find(&buffer, 0, aesd_circular_buffer_get_entry(&buffer, 0), 0);
+    TEST_ASSERT_EQUAL_PTR(offsets_test_writes[2 * AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED],
+            aesd_circular_buffer_get_entry(&buffer, 0)->buffptr);
+}
+
+void test_circular_buffer_offsets_after_remove_and_resize()
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry removed, *entries;
+    size_t first_offset, end_offset;
+    int i;
+    aesd_circular_buffer_init(&buffer);
+    for (i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED + 4; i++)
+        offsets_test_add(&buffer, i);
+    end_offset = buffer.end_offset;
+
+    first_offset = buffer.first_offset;
+    TEST_ASSERT_TRUE(aesd_circular_buffer_remove_oldest(&buffer, &removed));
+    TEST_ASSERT_EQUAL_UINT64(first_offset + removed.size, buffer.first_offset);
+    TEST_ASSERT_EQUAL_UINT64(end_offset, buffer.end_offset);
+    offsets_test_find_all(&buffer);
+
+    // a large buffer, where the binary search takes many steps, wrapped around
+    entries = calloc(1000, sizeof(struct aesd_buffer_entry));
+    TEST_ASSERT_NOT_NULL(entries);
+    aesd_circular_buffer_resize(&buffer, entries, 1000);
+    TEST_ASSERT_EQUAL_UINT64(end_offset, buffer.end_offset);
+    offsets_test_find_all(&buffer);
+    for (; i < OFFSETS_TEST_WRITES; i++)
+        offsets_test_add(&buffer, i);
+    TEST_ASSERT_TRUE(buffer.full);
+    TEST_ASSERT_TRUE_MESSAGE(buffer.out_offs != 0, "The buffer should have wrapped");
+    offsets_test_find_all(&buffer);
+
+    while (aesd_circular_buffer_count(&buffer) > AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
+        TEST_ASSERT_TRUE(aesd_circular_buffer_remove_oldest(&buffer, &removed));
+    aesd_circular_buffer_resize(&buffer, NULL, 0);
+    free(entries);
+    offsets_test_find_all(&buffer);
+    TEST_ASSERT_EQUAL_PTR(offsets_test_writes[OFFSETS_TEST_WRITES - 1],
+            aesd_circular_buffer_get_entry(&buffer,
+                AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - 1)->buffptr);
+}
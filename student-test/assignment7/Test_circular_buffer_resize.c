@@ -0,0 +1,173 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+
+/**
+ * Tests of the entry count, lookup, removal and resizing of the circular buffer, including
+ * buffers whose in_offs/out_offs wrapped around the end of the entry array.
+ */
+
+#define RESIZE_TEST_WRITES 32
+
+static char resize_test_writes[RESIZE_TEST_WRITES][16];
+
+/**
+ * Adds the write number @param number (a line "write<number>\n") to @param buffer
+ */
+static void resize_test_add(struct aesd_circular_buffer *buffer, int number)
+{
+    struct aesd_buffer_entry entry;
+    snprintf(resize_test_writes[number], sizeof(resize_test_writes[number]), "write%d\n", number);
+    entry.buffptr = resize_test_writes[number];
+    entry.size = strlen(resize_test_writes[number]);
+    aesd_circular_buffer_add_entry(buffer, &entry);
+}
+
+/**
+ * Checks that @param buffer holds the @param count writes from number @param first on, in order
+ */
+static void resize_test_verify(struct aesd_circular_buffer *buffer, int first, uint32_t count)
+{
+    uint32_t index;
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(count, aesd_circular_buffer_count(buffer),
+            "Unexpected number of entries");
+    for (index = 0; index < count; index++) {
+        struct aesd_buffer_entry *entry = aesd_circular_buffer_get_entry(buffer, index);
+        TEST_ASSERT_NOT_NULL_MESSAGE(entry, "Missing entry");
+        TEST_ASSERT_EQUAL_PTR_MESSAGE(resize_test_writes[first + index], entry->buffptr,
+                "Entries are out of order");
+    }
+    TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_get_entry(buffer, count),
+            "An entry past the newest one was returned");
+}
+
+void test_circular_buffer_count_and_get_entry()
+{
+    struct aesd_circular_buffer buffer;
+    int i;
+    aesd_circular_buffer_init(&buffer);
+    resize_test_verify(&buffer, 0, 0);
+
+    for (i = 0; i < 3; i++)
+        resize_test_add(&buffer, i);
+    resize_test_verify(&buffer, 0, 3);
+    TEST_ASSERT_FALSE(buffer.full);
+
+    for (; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++)
+        resize_test_add(&buffer, i);
+    resize_test_verify(&buffer, 0, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+    TEST_ASSERT_TRUE_MESSAGE(buffer.full, "A buffer with depth entries must be full");
+
+    // wrap around: the two oldest writes are overwritten
+    resize_test_add(&buffer, i++);
+    resize_test_add(&buffer, i++);
+    resize_test_verify(&buffer, 2, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+    TEST_ASSERT_EQUAL_UINT32(2, buffer.in_offs);
+    TEST_ASSERT_EQUAL_UINT32(2, buffer.out_offs);
+}
+
+void test_circular_buffer_remove_oldest_wrapped()
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry removed;
+    uint32_t count;
+    int i;
+    aesd_circular_buffer_init(&buffer);
+    TEST_ASSERT_FALSE_MESSAGE(aesd_circular_buffer_remove_oldest(&buffer, &removed),
+            "Removed an entry from an empty buffer");
+
+    for (i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED + 3; i++)
+        resize_test_add(&buffer, i);
+    // in_offs == out_offs == 3, full
+    for (count = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; count > 0; count--) {
+        int oldest = 3 + AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - count;
+        size_t first_offset = buffer.first_offset;
+        TEST_ASSERT_TRUE(aesd_circular_buffer_remove_oldest(&buffer, &removed));
+        TEST_ASSERT_EQUAL_PTR_MESSAGE(resize_test_writes[oldest], removed.buffptr,
+                "The oldest entry was not the one removed");
+        TEST_ASSERT_FALSE(buffer.full);
+        TEST_ASSERT_EQUAL_UINT32(3, buffer.in_offs);
+        TEST_ASSERT_EQUAL_UINT32((oldest + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED,
+                buffer.out_offs);
+        TEST_ASSERT_EQUAL_UINT64(first_offset + removed.size, buffer.first_offset);
+        resize_test_verify(&buffer, oldest + 1, count - 1);
+    }
+    TEST_ASSERT_FALSE(aesd_circular_buffer_remove_oldest(&buffer, &removed));
+    TEST_ASSERT_EQUAL_UINT64(buffer.end_offset, buffer.first_offset);
+
+    // the emptied buffer fills up again from where it stopped
+    for (i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++)
+        resize_test_add(&buffer, i);
+    resize_test_verify(&buffer, 0, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+    TEST_ASSERT_TRUE(buffer.full);
+}
+
+void test_circular_buffer_shrink_while_full()
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry removed, entries[4], *previous;
+    int i;
+    aesd_circular_buffer_init(&buffer);
+    for (i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED + 5; i++)
+        resize_test_add(&buffer, i);
+    // full and wrapped: writes 5 to 14, the oldest one at out_offs 5
+    while (aesd_circular_buffer_count(&buffer) > 4)
+        TEST_ASSERT_TRUE(aesd_circular_buffer_remove_oldest(&buffer, &removed));
+    TEST_ASSERT_EQUAL_PTR(resize_test_writes[10], removed.buffptr);
+
+    previous = aesd_circular_buffer_resize(&buffer, entries, 4);
+    TEST_ASSERT_EQUAL_PTR_MESSAGE(buffer.default_entry, previous,
+            "The previous entry array must be returned");
+    TEST_ASSERT_EQUAL_PTR(entries, buffer.entry);
+    TEST_ASSERT_EQUAL_UINT32(4, buffer.depth);
+    TEST_ASSERT_TRUE_MESSAGE(buffer.full, "4 entries kept in a depth of 4 must be full");
+    TEST_ASSERT_EQUAL_UINT32(0, buffer.out_offs);
+    TEST_ASSERT_EQUAL_UINT32(0, buffer.in_offs);
+    resize_test_verify(&buffer, 11, 4);
+
+    // the next write evicts the oldest one
+    resize_test_add(&buffer, i++);
+    resize_test_verify(&buffer, 12, 4);
+    TEST_ASSERT_EQUAL_UINT32(1, buffer.out_offs);
+    TEST_ASSERT_EQUAL_UINT32(1, buffer.in_offs);
+}
+
+void test_circular_buffer_grow_after_wrap()
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry removed, entries[16], *previous;
+    int i;
+    aesd_circular_buffer_init(&buffer);
+    for (i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED + 2; i++)
+        resize_test_add(&buffer, i);
+    // full and wrapped: writes 2 to 11
+    previous = aesd_circular_buffer_resize(&buffer, entries, 16);
+    TEST_ASSERT_EQUAL_PTR(buffer.default_entry, previous);
+    TEST_ASSERT_FALSE(buffer.full);
+    TEST_ASSERT_EQUAL_UINT32(0, buffer.out_offs);
+    TEST_ASSERT_EQUAL_UINT32(AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, buffer.in_offs);
+    resize_test_verify(&buffer, 2, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+
+    // the new room is used before anything is evicted, then the buffer wraps again
+    for (; i < 18; i++)
+        resize_test_add(&buffer, i);
+    resize_test_verify(&buffer, 2, 16);
+    TEST_ASSERT_TRUE(buffer.full);
+    for (; i < 21; i++)
+        resize_test_add(&buffer, i);
+    resize_test_verify(&buffer, 5, 16);
+    TEST_ASSERT_EQUAL_UINT32(3, buffer.out_offs);
+
+    // back to the default array, once the oldest entries that don't fit are removed
+    while (aesd_circular_buffer_count(&buffer) > AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
+        TEST_ASSERT_TRUE(aesd_circular_buffer_remove_oldest(&buffer, &removed));
+    previous = aesd_circular_buffer_resize(&buffer, NULL, 0);
+    TEST_ASSERT_EQUAL_PTR(entries, previous);
+    TEST_ASSERT_EQUAL_PTR(buffer.default_entry, buffer.entry);
+    TEST_ASSERT_EQUAL_UINT32(AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, buffer.depth);
+    TEST_ASSERT_TRUE(buffer.full);
+    resize_test_verify(&buffer, 11, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+}